@@ -0,0 +1,225 @@
+#include <uls/server.h>
+#include <uls/system.h>
+#include <uls/autocomplete.h>
+#include <uls/declarations.h>
+#include <uls/renaming.h>
+#include <uls/highlight.h>
+#include <uls/stats.h>
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+using json = nlohmann::json;
+
+/** Size of the generated model and the number of editing rounds replayed on it */
+struct BenchConfig
+{
+    int templates{50};
+    int globals{200};
+    int struct_depth{8};
+    int locations{20};
+    int edges{100};  // Per template
+    int rounds{100};
+    bool as_json{false};
+};
+
+BenchConfig parse_args(int argc, char* argv[])
+{
+    auto config = BenchConfig{};
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--json") {
+            config.as_json = true;
+            continue;
+        }
+        if (i + 1 == argc)
+            throw std::invalid_argument{"Missing value for " + std::string{arg}};
+        int value = std::stoi(argv[++i]);
+        if (arg == "--templates")
+            config.templates = value;
+        else if (arg == "--globals")
+            config.globals = value;
+        else if (arg == "--struct-depth")
+            config.struct_depth = value;
+        else if (arg == "--locations")
+            config.locations = value;
+        else if (arg == "--edges")
+            config.edges = value;
+        else if (arg == "--rounds")
+            config.rounds = value;
+        else
+            throw std::invalid_argument{"Unknown option " + std::string{arg}};
+    }
+    if (config.templates < 1 || config.globals < 1 || config.locations < 1)
+        throw std::invalid_argument{"The model needs at least one template, global and location"};
+    return config;
+}
+
+/** Declaration of every template, the benchmark edits and queries it at known offsets */
+std::string template_declaration(int index, const BenchConfig& config)
+{
+    return "int local = g" + std::to_string(index % config.globals) + ";\nclock c;\nS" +
+           std::to_string(config.struct_depth) + " state;\n";
+}
+
+/** Offset just after "int local = g" in template_declaration */
+constexpr uint32_t global_offset = 13;
+
+std::string generate_model(const BenchConfig& config)
+{
+    std::string xml = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                      "<!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' "
+                      "'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>\n<nta>\n<declaration>\n";
+    for (int i = 0; i < config.globals; ++i)
+        xml += "int g" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    xml += "chan step;\ntypedef struct { int value; } S0;\n";
+    for (int depth = 1; depth <= config.struct_depth; ++depth) {
+        xml += "typedef struct { int value; S" + std::to_string(depth - 1) + " inner; } S" + std::to_string(depth) +
+               ";\n";
+    }
+    for (int i = 0; i < config.globals; i += 10) {
+        xml += "int f" + std::to_string(i) + "(int a) {\n    int b = a + g" + std::to_string(i) +
+               ";\n    return b;\n}\n";
+    }
+    xml += "</declaration>\n";
+
+    for (int t = 0; t < config.templates; ++t) {
+        xml += "<template>\n<name>T" + std::to_string(t) + "</name>\n<declaration>" + template_declaration(t, config) +
+               "</declaration>\n";
+        for (int l = 0; l < config.locations; ++l) {
+            xml += "<location id=\"id" + std::to_string(l) + "\" x=\"" + std::to_string(l * 100) +
+                   "\" y=\"0\">\n<name>L" + std::to_string(l) + "</name>\n</location>\n";
+        }
+        xml += "<init ref=\"id0\"/>\n";
+        for (int e = 0; e < config.edges; ++e) {
+            auto global = "g" + std::to_string((t + e) % config.globals);
+            xml += "<transition>\n<source ref=\"id" + std::to_string(e % config.locations) + "\"/>\n<target ref=\"id" +
+                   std::to_string((e + 1) % config.locations) + "\"/>\n" +
+                   "<label kind=\"guard\" x=\"0\" y=\"0\">local &lt; " + global + " &amp;&amp; c &gt; 1</label>\n" +
+                   "<label kind=\"synchronisation\" x=\"0\" y=\"0\">step!</label>\n" +
+                   "<label kind=\"assignment\" x=\"0\" y=\"0\">local = " + global + " + 1, c = 0</label>\n" +
+                   "</transition>\n";
+        }
+        xml += "</template>\n";
+    }
+
+    xml += "<system>\n";
+    for (int t = 0; t < config.templates; ++t)
+        xml += "P" + std::to_string(t) + " = T" + std::to_string(t) + "();\n";
+    xml += "system ";
+    for (int t = 0; t < config.templates; ++t)
+        xml += (t == 0 ? "P" : ", P") + std::to_string(t);
+    xml += ";\n</system>\n</nta>\n";
+    return xml;
+}
+
+/** Every round edits one template and then queries it like an editor would while the user types */
+void write_session(std::ostream& in, const std::string& model, const BenchConfig& config)
+{
+    auto send = [&in](const std::string& cmd, const json& args) { in << json{{"cmd", cmd}, {"args", args}} << '\n'; };
+    send("upload", model);
+
+    const std::string inserted = "int extra;\n";
+    for (int round = 0; round < config.rounds; ++round) {
+        int templ = round % config.templates;
+        auto xpath = "/nta/template[" + std::to_string(templ + 1) + "]/declaration!";
+        auto global = "g" + std::to_string(templ % config.globals);
+        auto offset = global_offset + static_cast<uint32_t>(inserted.size());
+
+        send("edit", json::array({{{"xpath", xpath}, {"offset", 0}, {"length", 0}, {"text", inserted}}}));
+        send("autocomplete", {{"xpath", xpath}, {"offset", offset}, {"identifier", "g"}});
+        send("autocomplete", {{"xpath", xpath}, {"offset", offset}, {"identifier", "g"}, {"limit", 20}});
+        send("goto_decl", {{"xpath", xpath}, {"offset", offset}, {"identifier", global}});
+        send("find_usages", {{"xpath", xpath}, {"offset", offset}, {"identifier", global}});
+        send("keywords", xpath);
+        send("edit", json::array({{{"xpath", xpath}, {"offset", 0}, {"length", inserted.size()}, {"text", ""}}}));
+    }
+    send("stats", "");
+    send("exit", "");
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    try {
+        config = parse_args(argc, argv);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << "\nUsage: uls_bench [--templates N] [--globals N] [--struct-depth N] "
+                  << "[--locations N] [--edges N] [--rounds N] [--json]\n";
+        return 1;
+    }
+
+    auto model = generate_model(config);
+    auto in = std::stringstream{};
+    auto out = std::stringstream{};
+    write_session(in, model, config);
+
+    // Parsing happens inline such that upload and edit latencies include it
+    auto repo = SystemRepository{};
+    auto autocomplete = AutocompleteModule{repo};
+    auto declarations = DeclarationsModule{repo};
+    auto renaming = RenamingModule{repo};
+    auto highlight = Highlight{repo};
+    auto stats = StatsModule{};
+
+    auto server = Server{{in, out}};
+    server.add_close_command("exit")
+        .add_module(repo)
+        .add_module(autocomplete)
+        .add_module(declarations)
+        .add_module(renaming)
+        .add_module(highlight)
+        .add_module(stats);
+
+    auto start = std::chrono::steady_clock::now();
+    server.start();
+    auto wall_time = std::chrono::duration<double>{std::chrono::steady_clock::now() - start}.count();
+
+    std::string line;
+    std::getline(out, line);  // Handshake
+    size_t errors = 0;
+    json summary;
+    while (std::getline(out, line)) {
+        auto message = json::parse(line);
+        if (message["res"] == "err" && errors++ == 0)
+            std::cerr << "First error: " << message["info"] << '\n';
+        else if (message["res"] == "response/stats")
+            summary = std::move(message["info"]);
+    }
+
+    // Parses are listed next to the commands but are part of upload and edit requests
+    auto requests = uint64_t{0};
+    for (const auto& [name, entry] : summary.items()) {
+        if (name != "parse")
+            requests += entry["count"].get<uint64_t>();
+    }
+
+    if (config.as_json) {
+        std::cout << json{{"model_bytes", model.size()},
+                          {"wall_time_s", wall_time},
+                          {"requests_per_s", static_cast<double>(requests) / wall_time},
+                          {"errors", errors},
+                          {"commands", summary}}
+                  << '\n';
+        return errors == 0 ? 0 : 1;
+    }
+
+    std::printf("Model of %zu bytes, %d templates, %d globals, %d edges per template\n", model.size(),
+                config.templates, config.globals, config.edges);
+    std::printf("%-14s %8s %10s %10s %10s %12s\n", "command", "count", "p50 us", "p95 us", "p99 us", "handler us");
+    for (const auto& [name, entry] : summary.items()) {
+        std::printf("%-14s %8llu %10.1f %10.1f %10.1f %12.1f\n", name.c_str(),
+                    static_cast<unsigned long long>(entry["count"].get<uint64_t>()), entry["p50_us"].get<double>(),
+                    entry["p95_us"].get<double>(), entry["p99_us"].get<double>(),
+                    entry["mean_handler_us"].get<double>());
+    }
+    std::printf("%llu requests in %.3f s, %.0f requests/s, %zu errors\n", static_cast<unsigned long long>(requests),
+                wall_time, static_cast<double>(requests) / wall_time, errors);
+    return errors == 0 ? 0 : 1;
+}
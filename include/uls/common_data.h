@@ -2,9 +2,33 @@
 #include "server_module.h"
 #include <string>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <unordered_map>
 #include <nlohmann/json_fwd.hpp>
 #include <utap/document.h>
 
+class DocumentSnapshot;
+
+/**
+ * Monotonic memory for the temporaries of one request, nothing is freed before the arena is destroyed.
+ * The first arena alive on a thread uses a buffer kept by that thread, so steady state requests do not allocate.
+ */
+class RequestArena
+{
+    bool owns_thread_buffer;
+    std::pmr::monotonic_buffer_resource resource;
+
+public:
+    RequestArena();
+    RequestArena(const RequestArena&) = delete;
+    ~RequestArena();
+
+    std::pmr::memory_resource* get() { return &resource; }
+};
+
 struct Identifier
 {
     std::string xpath;
@@ -18,6 +42,27 @@ struct Deserializer<Identifier>
     static Identifier deserialize(const nlohmann::json& message);
 };
 
+/**
+ * Maps document positions to the xml node they belong to.
+ * The first line of every node is looked up once per snapshot, later conversions only do UTAP's line search.
+ */
+class PositionTable
+{
+public:
+    using Line = std::remove_cvref_t<decltype(std::declval<const UTAP::Document&>().find_first_position(0))>;
+
+private:
+    UTAP::Document& doc;
+    std::mutex mutex;
+    std::unordered_map<const std::string*, Line> node_starts;  // Keyed by the path of the lines in that node
+
+public:
+    explicit PositionTable(DocumentSnapshot& snapshot);
+
+    /** Same as doc.find_first_position(position) */
+    const Line& find_node_start(uint32_t position);
+};
+
 struct TextRange
 {
     uint32_t begOffset;
@@ -27,10 +72,10 @@ struct TextRange
     TextRange(uint32_t start, uint32_t end): begOffset{start}, endOffset{end} {}
 
     /** Create the range that contains the given symbol*/
-    TextRange(const UTAP::Document& doc, const UTAP::position_t& symbol);
+    TextRange(PositionTable& positions, const UTAP::position_t& symbol);
 
     /** Create a range that contains the symbol and everything after*/
-    static TextRange from(const UTAP::Document& doc, const UTAP::position_t& symbol);
+    static TextRange from(PositionTable& positions, const UTAP::position_t& symbol);
 
     /** Get the intersection between two ranges*/
     TextRange& intersect(const TextRange& other);
@@ -44,12 +89,13 @@ struct Serializer<TextRange>
     static nlohmann::json serialize(const TextRange& result);
 };
 
+/** Only valid while the snapshot the location was found in is alive, the path belongs to its document */
 struct TextLocation
 {
-    std::shared_ptr<std::string> path;
+    const std::string* path;
     TextRange range;
 
-    TextLocation(UTAP::Document& doc, const UTAP::position_t& pos);
+    TextLocation(PositionTable& positions, const UTAP::position_t& pos);
 };
 
 template <>
@@ -5,7 +5,7 @@
 #include <optional>
 #include <uls/utap_extension.h>
 
-std::optional<UtapEntity> find_declaration(UTAP::Document& doc, UTAP::declarations_t& decls,
+std::optional<UtapEntity> find_declaration(DocumentSnapshot& snapshot, UTAP::declarations_t& decls,
                                            std::string_view identifier);
 
 class DeclarationsModule : public ServerModule
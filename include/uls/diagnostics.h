@@ -0,0 +1,26 @@
+#pragma once
+#include "system.h"
+#include <nlohmann/json.hpp>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Reports the errors and warnings of every parse as "diagnostics" notifications.
+ * A notification maps xpaths to all diagnostics of that node and only holds the nodes whose diagnostics changed since
+ * the previous notification for the same document, an empty list clears a node.
+ */
+class DiagnosticsModule : public ServerModule
+{
+    SystemRepository& repository;
+    std::mutex mutex;  // Updates arrive from the parse worker and the command loop
+    // The diagnostics last sent per xpath, for each document id
+    std::unordered_map<std::string, std::unordered_map<std::string, nlohmann::json>> sent;
+
+    void update(Server& server, DocumentSnapshot& snapshot);
+
+public:
+    DiagnosticsModule(SystemRepository& repo): repository{repo} {}
+
+    void configure(Server& server) override;
+};
@@ -1,15 +1,106 @@
 #pragma once
 #include "system.h"
+#include "common_data.h"
+
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct Keyword
+{
+    std::string identifier;
+    std::string type;
+    TextRange valid_range;
+
+    /** Orders keywords such that two sorted lists can be diffed */
+    bool operator<(const Keyword& other) const;
+};
+
+/** Keywords of a snapshot, computed once per xpath */
+class KeywordTable
+{
+    DocumentSnapshot& snapshot;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::vector<Keyword>> keywords;
+
+public:
+    explicit KeywordTable(DocumentSnapshot& snapshot): snapshot{snapshot} {}
+
+    /** The keywords visible from xpath in the order the declarations walker visits them */
+    const std::vector<Keyword>& get(const std::string& xpath);
+};
+
+enum class TokenKind : uint8_t { variable, constant, function, type, channel, clock, process, location };
+
+/** Kinds of tokens by name, indexed by TokenKind */
+inline constexpr std::string_view token_kind_names[] = {"variable", "constant", "function", "type",
+                                                        "channel",  "clock",    "process",  "location"};
+
+struct SemanticToken
+{
+    uint32_t offset;
+    uint32_t length;
+    TokenKind kind;
+};
+
+/** Restricts semantic_tokens to the offsets [start, end] of one xml node, all tokens are sent without it */
+struct TokenRange
+{
+    std::string xpath;
+    uint32_t start{0};
+    uint32_t end{std::numeric_limits<uint32_t>::max()};
+};
+
+template <>
+struct Deserializer<std::optional<TokenRange>>
+{
+    static std::optional<TokenRange> deserialize(const nlohmann::json& message);
+};
+
+/**
+ * Every declared and used identifier of a snapshot sorted by offset within its xml node.
+ * Usages come from the single document walk of UsageIndex, declarations from the frames of each scope.
+ */
+class SemanticTokens
+{
+    std::unordered_map<std::string, std::vector<SemanticToken>> nodes;  // Keyed by the xpath of the node
+
+public:
+    explicit SemanticTokens(DocumentSnapshot& snapshot);
+
+    const std::unordered_map<std::string, std::vector<SemanticToken>>& get_nodes() const { return nodes; }
+};
 
 /**
  * The highlight module is used to generate text highlighting hints for the user interface
+ *
+ * Every "keywords" notification holds the full list. Clients sending "enable_keyword_diffs" only get the full list
+ * first, later notifications are "keywords_diff" with the keywords "added" and "removed" since the previous one.
+ *
+ * "semantic_tokens" responds with {"legend": [kind names], "nodes": {xpath: [offset, length, kind, ...]}}. The offset
+ * of each token is relative to the start of the previous token in the node and kind indexes the legend.
  */
 class Highlight : public ServerModule
 {
     SystemRepository& repository;
+    std::mutex mutex;  // Notifications are sent both from the parse worker and the command loop
+    std::vector<Keyword> sent;  // Sorted
+    bool has_sent{false};
+    bool send_diffs{false};  // Opted into by the client
+    bool notify_when_idle;
+
+    void notify(Server& server, DocumentSnapshot& snapshot, const std::string& xpath);
 
 public:
-    Highlight(SystemRepository& repo): repository{repo} {}
+    /** With notify_when_idle the keywords of an update are sent once the client stops changing the document */
+    Highlight(SystemRepository& repo, bool notify_when_idle = false):
+        repository{repo}, notify_when_idle{notify_when_idle}
+    {}
 
     void configure(Server& server) override;
-};
\ No newline at end of file
+};
@@ -1,5 +1,19 @@
 #pragma once
 #include "system.h"
+#include <map>
+#include <vector>
+
+/** Positions where each symbol is used, built with a single walk over the document on first use */
+class UsageIndex
+{
+    std::map<UTAP::symbol_t, std::vector<UTAP::position_t>> usages;
+
+public:
+    explicit UsageIndex(DocumentSnapshot& snapshot);
+
+    const std::vector<UTAP::position_t>& find(const UTAP::symbol_t& symbol) const;
+    const std::map<UTAP::symbol_t, std::vector<UTAP::position_t>>& get_all() const { return usages; }
+};
 
 class RenamingModule : public ServerModule
 {
@@ -0,0 +1,52 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/** Answers read-only commands without running them, installed through Server::set_response_cache */
+class ResponseCache
+{
+public:
+    struct Lookup
+    {
+        std::optional<nlohmann::json> response;  // Set when the command does not have to run
+        std::string key;
+        uint64_t state{0};  // Identifies the document the command is about to run on, 0 if it should not be stored
+    };
+
+    virtual ~ResponseCache() = default;
+
+    /** Called before the command runs, the arguments are still intact */
+    virtual Lookup lookup(const std::string& command, const nlohmann::json& args) = 0;
+    /** Called with the response of a command which lookup did not answer */
+    virtual void store(const Lookup& lookup, const nlohmann::json& response) = 0;
+};
+
+/**
+ * Responses of read-only commands for one model content.
+ * They are saved as CBOR in a directory, in a file named after the hash of the model xml.
+ */
+struct SavedResponses
+{
+    static constexpr size_t max_responses = 4096;
+
+    uint64_t content_hash{0};  // 0 when the content is not known, e.g. after an edit until it is parsed
+    std::unordered_map<std::string, nlohmann::json> responses;
+    bool is_modified{false};
+    // Lookups of a known content made before it was parsed, tells how often reopening is answered without parsing
+    uint64_t hits{0};
+    uint64_t misses{0};
+
+    /** FNV-1a which unlike std::hash is the same in every session */
+    static uint64_t hash(std::string_view content);
+    static std::string make_key(std::string_view command, const nlohmann::json& args);
+
+    /** Saves the responses of the old content if they changed and loads the ones saved for the new content */
+    void switch_content(const std::filesystem::path& directory, uint64_t new_hash);
+    void save(const std::filesystem::path& directory);
+    void add(std::string key, const nlohmann::json& response);
+};
@@ -1,17 +1,37 @@
 #pragma once
 #include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
 
+/**
+ * Commands receive their arguments as a mutable json, which the non-const overloads move out of instead of copying.
+ * Both text and binary strings are accepted.
+ */
 template <>
 struct Deserializer<std::string>
 {
     static std::string deserialize(const nlohmann::json& message);
+    static std::string deserialize(nlohmann::json& message);
+};
+/** Views the string in the message, only valid while the command runs */
+template <>
+struct Deserializer<std::string_view>
+{
+    static std::string_view deserialize(const nlohmann::json& message);
 };
 template <>
 struct Serializer<std::string>
 {
     static nlohmann::json serialize(const std::string& str);
+    static nlohmann::json serialize(std::string&& str);
 };
 
+template <>
+struct Deserializer<nlohmann::json&>
+{
+    static nlohmann::json& deserialize(nlohmann::json& message) { return message; }
+};
 template <>
 struct Deserializer<const nlohmann::json&>
 {
@@ -29,19 +49,39 @@ struct Deserializer<std::vector<ItemType>>
     static std::vector<ItemType> deserialize(const nlohmann::json& message)
     {
         std::vector<ItemType> data;
+        data.reserve(message.size());
         for (const auto& item : message)
             data.push_back(Deserializer<ItemType>::deserialize(item));
         return data;
     }
+
+    static std::vector<ItemType> deserialize(nlohmann::json& message)
+    {
+        std::vector<ItemType> data;
+        data.reserve(message.size());
+        for (auto& item : message)
+            data.push_back(Deserializer<ItemType>::deserialize(item));
+        return data;
+    }
 };
 template <typename ItemType>
 struct Serializer<std::vector<ItemType>>
 {
     static nlohmann::json serialize(const std::vector<ItemType>& data)
     {
-        nlohmann::json json_array;
+        nlohmann::json::array_t json_array;
+        json_array.reserve(data.size());
         for (const auto& item : data)
             json_array.push_back(Serializer<ItemType>::serialize(item));
         return json_array;
     }
+
+    static nlohmann::json serialize(std::vector<ItemType>&& data)
+    {
+        nlohmann::json::array_t json_array;
+        json_array.reserve(data.size());
+        for (auto& item : data)
+            json_array.push_back(Serializer<ItemType>::serialize(std::move(item)));
+        return json_array;
+    }
 };
\ No newline at end of file
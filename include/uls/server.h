@@ -1,21 +1,63 @@
 #pragma once
 #include "server_module.h"
 #include "serialization.h"
+#include "stats.h"
+#include "worker_pool.h"
+#include "response_cache.h"
 
 #include <string>
+#include <string_view>
 #include <functional>
+#include <unordered_map>
 #include <vector>
+#include <memory>
+#include <optional>
+#include <cstdint>
+#include <algorithm>
 #include <iosfwd>
+#include <mutex>
+#include <thread>
+
+/** Receives the elements of a streamed array response one at a time */
+class ResultSink
+{
+public:
+    virtual ~ResultSink() = default;
+
+    /** Returns false once the result cap is reached, the command should then stop producing elements */
+    virtual bool push(const nlohmann::json& element) = 0;
+};
 
 struct Command
 {
+    using StreamCallback = std::function<void(nlohmann::json&, RequestTiming&, ResultSink&)>;
+
     std::string name;
-    std::function<nlohmann::json(nlohmann::json&)> callback;
+    std::function<nlohmann::json(nlohmann::json&, RequestTiming&)> callback;
+    bool is_read_only{false};
+    StreamCallback stream{};  // Set for streaming commands, callback then collects the stream into a json value
+};
+
+/** Allows looking up commands by the name in a message without copying it */
+struct CommandNameHash
+{
+    using is_transparent = void;
+    size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
 };
 
 extern nlohmann::json OK_RESPONSE;
 extern nlohmann::json FAIL_RESPONSE;
 
+class StreamedResponse;
+
+/** Encoding of messages after the handshake, binary formats are framed by their size as a 4 byte big endian number */
+enum class WireFormat
+{
+    json,
+    cbor,
+    msgpack
+};
+
 struct IOStream
 {
     std::istream& in;
@@ -24,12 +66,59 @@ struct IOStream
 
 class Server
 {
-    std::vector<Command> commands;
+    std::unordered_map<std::string, Command, CommandNameHash, std::equal_to<>> commands;
+    std::vector<ServerModule*> modules;
     IOStream io;
+    Statistics statistics;
+    std::mutex output_mutex;  // Notifications may be sent from module threads
     bool is_running{false};
+    std::thread::id loop_thread;
+    size_t worker_count{std::max(1U, std::thread::hardware_concurrency())};
+    std::unique_ptr<WorkerPool> workers;  // Started by the first concurrent request
+    ResponseCache* response_cache{nullptr};
+    std::vector<std::function<std::function<std::shared_ptr<void>()>()>> batch_contexts;
+    WireFormat wire_format{WireFormat::json};  // Only changed by the command loop while holding output_mutex
+    std::optional<WireFormat> requested_format;
+    std::vector<uint8_t> frame;  // Reused buffer for binary messages, guarded by output_mutex
 
-    void send(const std::string& message_type, const nlohmann::json& message);
-    void send_error(const nlohmann::json& message);
+    /** Returns false if the input ended in the middle of a binary message */
+    bool read_message(nlohmann::json& message);
+    /** Writes a binary frame whose info value is appended by append_info, must hold output_mutex */
+    void write_frame(const std::string& message_type, const std::function<void(std::vector<uint8_t>&)>& append_info,
+                     const nlohmann::json* id);
+    /** Same as send but the caller holds output_mutex */
+    void write_message(const std::string& message_type, const nlohmann::json& message, const nlohmann::json* id);
+    void switch_wire_format(WireFormat format);
+
+    void send(const std::string& message_type, const nlohmann::json& message, const nlohmann::json* id = nullptr);
+    void send_streamed(const std::string& message_type, const StreamedResponse& response, const nlohmann::json* id);
+    void send_error(const nlohmann::json& message, const nlohmann::json* id = nullptr);
+    void flush();
+    /** The first command registered with a given name is kept */
+    Server& register_command(Command command);
+    void handle(Command& cmd, nlohmann::json& args, const nlohmann::json* id);
+    void handle_streamed(Command& cmd, nlohmann::json& args, const nlohmann::json* id);
+    /** Runs a streaming command and returns its response as one json value, e.g. for batches */
+    static nlohmann::json collect_stream(const Command::StreamCallback& stream, nlohmann::json& args,
+                                         RequestTiming& timing);
+    void handle_concurrently(Command& cmd, nlohmann::json id, nlohmann::json args);
+    /** Captures every batch context on the calling thread, they are entered where the request runs */
+    std::vector<std::function<std::shared_ptr<void>()>> capture_contexts() const;
+
+    template <typename Data, typename Func>
+    static auto make_handler(Func callback)
+    {
+        return [callback](nlohmann::json& message, RequestTiming& timing) {
+            auto stopwatch = Stopwatch{};
+            decltype(auto) data = Deserializer<Data>::deserialize(message);
+            timing.deserialize = stopwatch.lap();
+            auto result = callback(std::forward<decltype(data)>(data));
+            timing.handler = stopwatch.lap();
+            auto response = Serializer<std::invoke_result_t<Func, Data>>::serialize(std::move(result));
+            timing.serialize = stopwatch.lap();
+            return response;
+        };
+    }
 
 public:
     Server(IOStream io): io(std::move(io)) {}
@@ -38,30 +127,100 @@ public:
     template <typename ReturnType>
     Server& add_simple_command(std::string name, std::function<ReturnType()> callback)
     {
-        commands.push_back(
-            {name, [callback](nlohmann::json&) { return Serializer<ReturnType>::serialize(callback()); }});
-        return *this;
+        auto handler = [callback](nlohmann::json&, RequestTiming& timing) {
+            auto stopwatch = Stopwatch{};
+            auto result = callback();
+            timing.handler = stopwatch.lap();
+            auto response = Serializer<ReturnType>::serialize(std::move(result));
+            timing.serialize = stopwatch.lap();
+            return response;
+        };
+        return register_command({std::move(name), std::move(handler)});
     }
 
+    /** Data may be nlohmann::json& or const nlohmann::json& to get the raw arguments without copying them */
     template <typename Data, typename Func>
     Server& add_command(std::string name, Func callback)
     {
-        commands.push_back({std::move(name), [callback](nlohmann::json& message) -> nlohmann::json {
-                                auto result = callback(Deserializer<Data>::deserialize(message));
-                                return Serializer<std::invoke_result_t<Func, Data>>::serialize(std::move(result));
-                            }});
-        return *this;
+        return register_command({std::move(name), make_handler<Data>(std::move(callback))});
+    }
+
+    /**
+     * Same as add_command for commands that only read the current document snapshot.
+     * Requests carrying an id run on worker threads and may be answered out of order, inside the batch contexts
+     * captured when they were received.
+     */
+    template <typename Data, typename Func>
+    Server& add_read_only_command(std::string name, Func callback)
+    {
+        return register_command({std::move(name), make_handler<Data>(std::move(callback)), true});
+    }
+
+    /**
+     * Read-only command answering with an array whose elements the callback pushes to a ResultSink as it finds them.
+     * Each element is encoded when it is pushed instead of first collecting a json array, but the response is still
+     * buffered and only written once the callback returns.
+     *
+     * With a "limit" in the arguments the response is {"items": [...]} with at most limit elements, together with a
+     * "continuation" if there are more. Sending the same command with that "continuation" gives the next page.
+     * Pages stay consistent as long as the command pushes the same elements in the same order.
+     */
+    template <typename Data, typename Func>
+    Server& add_streaming_command(std::string name, Func callback)
+    {
+        auto stream = [callback](nlohmann::json& message, RequestTiming& timing, ResultSink& sink) {
+            auto stopwatch = Stopwatch{};
+            decltype(auto) data = Deserializer<Data>::deserialize(message);
+            timing.deserialize = stopwatch.lap();
+            callback(std::forward<decltype(data)>(data), sink);
+            timing.handler = stopwatch.lap();
+        };
+        auto collect = [stream](nlohmann::json& message, RequestTiming& timing) {
+            return collect_stream(stream, message, timing);
+        };
+        return register_command({std::move(name), std::move(collect), true, std::move(stream)});
     }
 
     Server& add_close_command(std::string name);
 
+    /**
+     * Runs the read-only commands of an array of {"cmd", "args"} objects in order and responds with an array holding
+     * the response of each, or {"error": message} for those that failed.
+     */
+    Server& add_batch_command(std::string name);
+
+    /**
+     * Called on the command loop when a batch or a concurrent request is received, e.g. to pin the document it was
+     * sent for. The returned function enters the context on the thread running the request and the object it returns
+     * is kept alive until the request ends.
+     */
+    Server& add_batch_context(std::function<std::function<std::shared_ptr<void>()>()> capture);
+
+    /** Drops the queued read-only requests with the id given as argument, they are answered with an error */
+    Server& add_cancel_command(std::string name);
+
+    /**
+     * Switches to the wire format given as argument ("json", "cbor" or "msgpack") after responding.
+     * Binary formats let upload send the document as a byte string which needs no escaping.
+     */
+    Server& add_wire_format_command(std::string name);
+
+    /** Lets the cache answer read-only commands before they run, must be set before the server starts */
+    Server& set_response_cache(ResponseCache& cache);
+
+    /** Number of threads running concurrent requests, must be set before the server starts */
+    Server& set_worker_count(size_t count);
+
     template <typename Data>
     void send_notification(const std::string& type, Data&& element)
     {
-        auto message = Serializer<std::remove_reference_t<Data>>::serialize(std::forward<Data>(element));
+        auto message = Serializer<std::remove_cvref_t<Data>>::serialize(std::forward<Data>(element));
         send("notif/" + type, message);
     }
 
+    /** Latencies of every command handled so far */
+    Statistics& get_statistics() { return statistics; }
+
     void start();
     void stop();
 };
\ No newline at end of file
@@ -13,4 +13,7 @@ class ServerModule
 {
 public:
     virtual void configure(Server& server) = 0;
+
+    /** Called when the server stops, modules owning threads must stop them here */
+    virtual void shutdown() {}
 };
\ No newline at end of file
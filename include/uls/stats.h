@@ -0,0 +1,87 @@
+#pragma once
+#include "server_module.h"
+#include <nlohmann/json_fwd.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+/** Time spent in each step of handling one request */
+struct RequestTiming
+{
+    std::chrono::nanoseconds deserialize{0};
+    std::chrono::nanoseconds handler{0};
+    std::chrono::nanoseconds serialize{0};  // Includes writing the response
+
+    std::chrono::nanoseconds total() const { return deserialize + handler + serialize; }
+};
+
+/** Measures the time between consecutive laps */
+class Stopwatch
+{
+    std::chrono::steady_clock::time_point last{std::chrono::steady_clock::now()};
+
+public:
+    std::chrono::nanoseconds lap()
+    {
+        auto now = std::chrono::steady_clock::now();
+        return now - std::exchange(last, now);
+    }
+};
+
+/**
+ * Request counts and latencies of every command.
+ * Percentiles are computed over the most recent requests while counts and phase times cover the whole session.
+ */
+class Statistics
+{
+    static constexpr size_t max_samples = 1024;
+
+    struct Entry
+    {
+        uint64_t count{0};
+        RequestTiming totals;
+        std::vector<std::chrono::nanoseconds> latencies;  // Ring buffer of the last max_samples requests
+        size_t next_sample{0};
+    };
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+
+public:
+    /** Safe to call from any thread, SystemRepository records its parses as "parse" */
+    void record(const std::string& name, const RequestTiming& timing);
+    nlohmann::json summary() const;
+};
+
+/**
+ * Provides the "stats" command and optionally sends the statistics as a "stats" notification at a fixed interval.
+ * The "stats_interval" command takes the interval in milliseconds, 0 stops the notifications.
+ */
+class StatsModule : public ServerModule
+{
+    Server* server{nullptr};
+    std::mutex mutex;
+    std::condition_variable interval_changed;
+    std::chrono::milliseconds interval;
+    std::thread notifier;
+    bool is_stopping{false};
+
+    void set_interval(std::chrono::milliseconds new_interval);
+    void run_notifier();
+
+public:
+    explicit StatsModule(std::chrono::milliseconds notify_interval = std::chrono::milliseconds{0}):
+        interval{notify_interval}
+    {}
+    StatsModule(const StatsModule&) = delete;
+    ~StatsModule() { shutdown(); }
+
+    void configure(Server& server) override;
+    void shutdown() override;
+};
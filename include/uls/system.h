@@ -1,43 +1,351 @@
 #pragma once
 #include "server_module.h"
+#include "stats.h"
+#include "response_cache.h"
+#include <nlohmann/json_fwd.hpp>
 #include <utap/utap.h>
 #include <memory>
 #include <functional>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+#include <typeindex>
+#include <limits>
 
-struct WorkingDocument
+/**
+ * Describes which top level sections of the model changed since the previous parse
+ * Sections are named by their xpath e.g. "/nta/declaration", "/nta/template[2]", "/nta/system" or "/nta/queries"
+ */
+struct DocumentChange
 {
-    std::string document;
+    std::vector<std::string> sections;
+
+    /** Change that affects every xpath, used for the first parse and when anything outside the sections change */
+    static DocumentChange everything() { return {{"/nta"}}; }
+
+    bool empty() const { return sections.empty(); }
+
+    /** Adds the sections of other such that the result covers both changes */
+    void merge(const DocumentChange& other);
+
+    /** Check if the declarations visible from xpath may have changed based on which sections depend on each other */
+    bool affects(std::string_view xpath) const;
+};
+
+/** A single change to the text of one xml node, offsets are relative to the unescaped node text */
+struct TextEdit
+{
+    std::string xpath;
+    uint32_t offset;
+    uint32_t length;
+    std::string text;
+};
+
+template <>
+struct Deserializer<TextEdit>
+{
+    static TextEdit deserialize(const nlohmann::json& message);
+    static TextEdit deserialize(nlohmann::json& message);
+};
+
+/**
+ * The model split into xml pieces such that every editable text node is stored separately.
+ * Edits only touch the node they target instead of copying the entire model.
+ *
+ * The markup between text nodes never changes and is kept in a single buffer, which can be spilled to a file while
+ * the document is not being edited. The file is then only read when the model is turned back into xml.
+ */
+class WorkingDocument
+{
+    struct Piece
+    {
+        size_t start;  // Index into texts for text pieces, offset into the markup buffer otherwise
+        size_t length;  // Only used by markup pieces
+        bool is_text;  // Text pieces are stored unescaped and are escaped again when parsing
+    };
+
+    struct Section
+    {
+        std::string xpath;
+        size_t first_piece;
+        size_t markup_hash;  // Combined hash of the markup pieces, the text pieces are added by update_hash
+        size_t hash;
+    };
+
+    struct NodeRef
+    {
+        size_t text;
+        size_t section;
+    };
 
 public:
-    void set_document(std::string document);
-    void insert(std::string str, int offset);
-    void remove(int offset, int length);
-    std::unique_ptr<UTAP::Document> parse() const;
+    /** A copy of the model taken at some point in time which can be parsed without access to the working document */
+    struct Revision
+    {
+        std::string xml;
+        std::unordered_map<std::string, size_t> section_hashes;
+        DocumentChange change;
+
+        std::unique_ptr<UTAP::Document> parse() const;
+    };
+
+    /** Bytes held by each part of the document */
+    struct MemoryStats
+    {
+        size_t markup;  // Resident markup
+        size_t spilled_markup;
+        size_t text;
+        size_t xpaths;
+        size_t pieces;  // Bookkeeping for pieces, sections and text node lookup
+    };
+
+private:
+    std::vector<Piece> pieces;
+    std::string markup;
+    std::vector<std::string> texts;
+    std::vector<Section> sections;  // Consecutive ranges of pieces, content outside sections belong to "/nta"
+    std::string xpath_buffer;  // Every text node xpath, the keys of text_nodes point into it
+    std::unordered_map<std::string_view, NodeRef> text_nodes;
+    std::unordered_map<std::string, size_t> parsed_sections;
+    std::filesystem::path spill_file;  // Holds the markup while it is spilled, empty otherwise
+    size_t spilled_size{0};
+
+    void update_hash(size_t section);
+    std::unordered_map<std::string, size_t> section_hashes() const;
+    DocumentChange get_changes(const std::unordered_map<std::string, size_t>& hashes) const;
+    void remove_spill_file();
+
+public:
+    WorkingDocument() = default;
+    WorkingDocument(const WorkingDocument&) = delete;
+    ~WorkingDocument() { remove_spill_file(); }
+
+    void set_document(std::string_view document);
+
+    /** Applies the edit to the node given by its xpath, throws if the node or range does not exist */
+    void apply_edit(const TextEdit& edit);
+
+    /** Get the unescaped text of a node, the trailing '!' of editor xpaths is optional */
+    std::string_view get_text(std::string_view xpath) const;
+    /** Reads spilled markup back from its file for the duration of the call */
+    std::string to_xml() const;
+
+    bool empty() const { return pieces.empty(); }
+    /** Bytes of model text and xpaths held, spilled or not, used to estimate the size of a document */
+    size_t memory_usage() const;
+    MemoryStats get_memory_stats() const;
+
+    /** Moves the markup to file, returns false and keeps the markup in memory if it could not be written */
+    bool spill_markup(const std::filesystem::path& file);
+    /** Loads spilled markup back into memory, throws if the file can no longer be read */
+    void restore_markup();
+    bool is_spilled() const { return !spill_file.empty(); }
+
+    /** Sections that changed since the last parsed revision */
+    DocumentChange get_changes() const;
+    Revision get_revision() const;
+    void set_parsed(const Revision& revision) { parsed_sections = revision.section_hashes; }
+    std::unique_ptr<UTAP::Document> parse();
 };
 
-/** This module stores information about the current document and is mainly used to provide events for other modules */
-class SystemRepository : public ServerModule
+/**
+ * A parsed version of the model together with data derived from it.
+ * Derived data is computed once per snapshot, the first time it is requested.
+ */
+class DocumentSnapshot
 {
-    std::unique_ptr<UTAP::Document> doc;
+    struct Analysis
+    {
+        std::once_flag is_computed;
+        std::shared_ptr<void> value;
+    };
+
+    std::unique_ptr<UTAP::Document> document;
+    uint64_t version;
+    std::string document_id;
+    std::mutex mutex;
+    std::unordered_map<std::type_index, std::shared_ptr<Analysis>> analyses;
+
+public:
+    DocumentSnapshot(std::unique_ptr<UTAP::Document> document, uint64_t version, std::string document_id = {}):
+        document{std::move(document)}, version{version}, document_id{std::move(document_id)}
+    {}
+
+    // This should return a const reference but UTAP does not fully support const yet
+    UTAP::Document& get_document() { return *document; }
+    uint64_t get_version() const { return version; }
+    /** The id of the open document this is a snapshot of, "" for the document used before any is selected */
+    const std::string& get_document_id() const { return document_id; }
+
+    /**
+     * Get the analysis T which is constructed from this snapshot on first use.
+     * Concurrent requests for the same analysis wait for the first one to finish.
+     */
+    template <typename T>
+    T& get()
+    {
+        std::shared_ptr<Analysis> analysis;
+        {
+            auto lock = std::lock_guard{mutex};
+            auto& slot = analyses[std::type_index{typeid(T)}];
+            if (slot == nullptr)
+                slot = std::make_shared<Analysis>();
+            analysis = slot;
+        }
+        std::call_once(analysis->is_computed, [&] { analysis->value = std::make_shared<T>(*this); });
+        return *static_cast<T*>(analysis->value.get());
+    }
+};
+
+/** Everything kept for one document of the workspace */
+struct OpenDocument
+{
+    std::string id;
     WorkingDocument working_doc;
+    std::shared_ptr<DocumentSnapshot> doc;
     std::string current_node{"/nta/template[1]"};
-    std::vector<std::function<void(UTAP::Document&)>> on_document_update;
+    uint64_t requested_version{0};
+    uint64_t parsed_version{0};
+    uint64_t last_used{0};
+    uint64_t publish_number{0};  // Unique among all documents, tells which snapshot a response was computed from
+    SavedResponses saved_responses;  // Responses for the current model text when it is known
+};
+
+/**
+ * This module stores information about the current document and is mainly used to provide events for other modules
+ *
+ * Parsing happens either directly in the upload/edit commands or on a background thread.
+ * Handlers always see the last successfully parsed document which stays alive for as long as they hold it.
+ *
+ * Several documents may be open at once, identified by the client. Commands work on the selected document which is
+ * "" until "select_document" is used. The least recently selected documents are closed once the open documents
+ * exceed the memory budget.
+ *
+ * With a response cache directory the responses of read-only commands are saved per model content. Uploading a model
+ * seen in an earlier session answers those commands from the saved responses until its first parse finishes, but only
+ * when a command is sent with exactly the same arguments as before. Everything else waits for the parse.
+ *
+ * "memory_stats" responds with the bytes each open document holds per structure together with the memory budget, and
+ * how many lookups the saved responses answered or missed before the parse.
+ */
+class SystemRepository : public ServerModule, public ResponseCache
+{
+    std::unordered_map<std::string, std::shared_ptr<OpenDocument>> documents{{"", std::make_shared<OpenDocument>()}};
+    std::shared_ptr<OpenDocument> active{documents[""]};
+    std::vector<std::function<void(DocumentSnapshot&, const DocumentChange&)>> on_document_update;
     std::vector<std::function<void(const std::string&)>> on_current_node_changed;
+    std::vector<std::function<void(DocumentSnapshot&, const DocumentChange&)>> on_document_idle;
 
-    void upload(std::string document);
+    // Guards everything above which is shared with the parse worker
+    mutable std::mutex mutex;
+    mutable std::condition_variable document_changed;
+    uint64_t use_count{0};
+    uint64_t publish_count{0};
+    size_t memory_budget{std::numeric_limits<size_t>::max()};
+    std::chrono::milliseconds debounce{0};
+    std::thread parse_worker;
+    bool skip_debounce{false};  // Set by parse_pending, the next parse starts without waiting for the debounce
+    bool is_stopping{false};
+    Statistics* statistics{nullptr};
+    std::chrono::milliseconds idle_period{200};
+    std::thread idle_worker;
+    std::shared_ptr<DocumentSnapshot> idle_snapshot;  // Latest update not yet seen by the idle handlers
+    bool skip_idle_period{false};  // Set by flush_idle, the pending update is handled without waiting
+    DocumentChange idle_change;
+    uint64_t update_count{0};
+    std::filesystem::path cache_directory;  // Empty when responses are not saved
+    std::filesystem::path spill_directory;  // Empty when the markup of every document stays in memory
+    uint64_t spill_count{0};
+
+    void upload(std::string_view document);
+    void edit(const std::vector<TextEdit>& edits);
+    void update_document(std::unique_lock<std::mutex>& lock);
+    /** Makes the parsed document current and fires the update event if target is selected, releases the lock */
+    void publish(std::unique_lock<std::mutex>& lock, std::shared_ptr<OpenDocument> target,
+                 const WorkingDocument::Revision& revision, uint64_t version, std::unique_ptr<UTAP::Document> parsed);
     void change_node(std::string xpath);
+    /** Returns true if the document was already open, otherwise it must be uploaded */
+    bool select_document(const std::string& id);
+    void close_document(const std::string& id);
+    void evict_documents();
+    /** Saves the responses of the previous content and loads those of the new content, empty if it is not known */
+    void switch_responses(OpenDocument& document, std::string_view content);
+    nlohmann::json memory_stats() const;
+    void run_parse_worker();
+    void run_idle_worker();
+    /** Fires the update handlers and queues the update for the idle handlers, must be called without the lock */
+    void fire_update(const std::shared_ptr<DocumentSnapshot>& snapshot, const DocumentChange& change);
+    void record_parse(std::chrono::nanoseconds parse_time);
+    /**
+     * Captures the current snapshot, entering the returned function makes get_snapshot on that thread return it until
+     * the object it returns is destroyed. Nothing is pinned before the first parse, commands then wait where they run.
+     */
+    std::function<std::shared_ptr<void>()> pin_snapshot();
 
 public:
+    SystemRepository() = default;
+    SystemRepository(const SystemRepository&) = delete;
+    ~SystemRepository() { shutdown(); }
+
+    /**
+     * Parse on a background thread instead of in the upload/edit commands.
+     * Parsing starts once no changes have arrived within the debounce period,
+     * versions superseded before their parse starts are never parsed.
+     */
+    void enable_background_parsing(std::chrono::milliseconds debounce_period);
+
+    /** Start parsing the changes waiting for the debounce period right away, does nothing without background parsing */
+    void parse_pending();
+
+    /** Size in bytes of model text the open documents may use, parsed documents grow with their text */
+    void set_memory_budget(size_t budget);
+
+    /** Save the responses of read-only commands in the directory, must be enabled before the module is added */
+    void enable_response_cache(std::filesystem::path directory);
+
+    /**
+     * Spill the markup of documents that are not selected to files in the directory.
+     * Their parsed documents stay in memory, the markup is read back when they are parsed or selected again.
+     */
+    void enable_compact_storage(std::filesystem::path directory);
+
     void configure(Server& server) override;
+    void shutdown() override;
+
+    Lookup lookup(const std::string& command, const nlohmann::json& args) override;
+    void store(const Lookup& lookup, const nlohmann::json& response) override;
 
-    void add_on_document_update(std::function<void(UTAP::Document&)> handler);
+    void add_on_document_update(std::function<void(DocumentSnapshot&, const DocumentChange&)> handler);
     void add_on_current_node_changed(std::function<void(const std::string&)> handler);
 
-    // This should return a const reference but UTAP does not fully support const yet
-    UTAP::Document& get_document() { return *doc; }
-    const WorkingDocument& get_working_document() { return working_doc; }
-    bool has_document() { return doc != nullptr; }
+    /**
+     * Like add_on_document_update but deferred until no update has arrived for the idle period.
+     * The handler runs on a separate thread with the latest snapshot and every change since its previous call.
+     */
+    void add_on_document_idle(std::function<void(DocumentSnapshot&, const DocumentChange&)> handler);
+    /** Must be set before the first idle handler is added */
+    void set_idle_period(std::chrono::milliseconds period);
+    /** Run the idle handlers for the updates waiting on the idle period right away */
+    void flush_idle();
 
-    const std::string& get_current_xpath() { return current_node; }
-};
\ No newline at end of file
+    /**
+     * Get the last parsed document, waits for the first parse if an upload is still pending.
+     * Throws if there is no document because the first parse failed.
+     * Commands of a batch all get the snapshot that was current when the batch started.
+     */
+    std::shared_ptr<DocumentSnapshot> get_snapshot() const;
+
+    /** Shorthand for the document of get_snapshot() which keeps the snapshot alive */
+    std::shared_ptr<UTAP::Document> get_document() const;
+    /** The selected document, only safe to use while no commands are being handled */
+    const WorkingDocument& get_working_document() const { return active->working_doc; }
+    bool has_document() const;
+
+    std::string get_current_xpath() const;
+};
@@ -4,8 +4,15 @@
 #include <utap/utap.h>
 #include <uls/server.h>
 #include <uls/common_data.h>
+#include <uls/system.h>
 #include <string_view>
 #include <variant>
+#include <optional>
+#include <unordered_map>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <list>
 
 /**
  * Uses a xpath to find the relevant declarations in the given document
@@ -15,14 +22,55 @@
  * "/nta/system!" leads to the system declarations
  * "/nta/template[1]/..." leads to the declarations of the first template
  */
-UTAP::declarations_t& navigate_xpath(UTAP::Document& doc, std::string_view path);
+UTAP::declarations_t& navigate_xpath(DocumentSnapshot& snapshot, std::string_view path);
 
 /**
  * Similar to previous overload but will return function scope iff pos is inside said function
  */
-UTAP::declarations_t& navigate_xpath(UTAP::Document& doc, std::string_view path, uint32_t pos);
+UTAP::declarations_t& navigate_xpath(DocumentSnapshot& snapshot, std::string_view path, uint32_t pos);
 
-std::optional<std::reference_wrapper<UTAP::template_t>> find_process(UTAP::Document& doc, std::string_view name);
+/**
+ * Resolves xpaths to scopes for navigate_xpath.
+ * Templates are indexed for random access and resolved xpaths are cached. On first use the function bodies of a scope
+ * are arranged in a tree by containment, each level sorted by position, such that finding the innermost body
+ * containing an offset is a binary search per nesting level.
+ */
+class ScopeTable
+{
+    struct FunctionBody
+    {
+        uint32_t begin;
+        uint32_t end;
+        UTAP::declarations_t* body;
+        std::vector<FunctionBody> nested;  // Bodies of the functions declared inside this one
+    };
+
+    struct XpathHash
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view xpath) const { return std::hash<std::string_view>{}(xpath); }
+    };
+
+    UTAP::Document& doc;
+    PositionTable& positions;
+    std::vector<UTAP::template_t*> templates;
+    std::mutex mutex;
+    std::unordered_map<std::string, UTAP::declarations_t*, XpathHash, std::equal_to<>> scopes;
+    std::unordered_map<const UTAP::declarations_t*, std::vector<FunctionBody>> function_bodies;
+
+    UTAP::declarations_t& parse(std::string_view path) const;
+    /** Takes the part of the xpath after "template[", throws if the index is malformed or out of range */
+    UTAP::template_t& get_template(std::string_view path) const;
+    std::vector<FunctionBody> index_functions(std::list<UTAP::function_t>& functions) const;
+
+public:
+    explicit ScopeTable(DocumentSnapshot& snapshot);
+
+    UTAP::declarations_t& resolve(std::string_view path);
+    UTAP::declarations_t& resolve(std::string_view path, uint32_t pos);
+};
+
+std::optional<std::reference_wrapper<UTAP::template_t>> find_process(DocumentSnapshot& snapshot, std::string_view name);
 
 /**
  * This class is used to iterate through symbols from a given declarations
@@ -30,7 +78,7 @@ std::optional<std::reference_wrapper<UTAP::template_t>> find_process(UTAP::Docum
  */
 struct DeclarationsWalker
 {
-    const UTAP::Document& doc;
+    PositionTable& positions;
     bool checkChildren;
 
     template <typename Func>
@@ -40,7 +88,7 @@ struct DeclarationsWalker
 
         if (checkChildren) {
             for (auto& func : decls.functions) {
-                if (traverse_function(func, TextRange{doc, func.body_position}, f))
+                if (traverse_function(func, TextRange{positions, func.body_position}, f))
                     return;
             }
         }
@@ -56,12 +104,12 @@ private:
     bool traverse_function(UTAP::function_t& function, const TextRange& func_range, Func f)
     {
         for (auto& func : function.body->functions) {
-            auto range = TextRange::from(doc, func.uid.get_position());
+            auto range = TextRange::from(positions, func.uid.get_position());
 
             if (f(func.uid, range.intersect(func_range)))
                 return true;
 
-            if (traverse_function(func, TextRange{doc, func.body_position}, f))
+            if (traverse_function(func, TextRange{positions, func.body_position}, f))
                 return true;
         }
 
@@ -87,7 +135,7 @@ private:
     {
         for (auto& symbol : frame) {
             if (!symbol.get_type().is_location()) {
-                auto range = TextRange::from(doc, symbol.get_position());
+                auto range = TextRange::from(positions, symbol.get_position());
                 if (f(symbol, range.intersect(scope_range)))
                     return true;
             }
@@ -97,6 +145,30 @@ private:
     }
 };
 
+/**
+ * Hash index of the symbols visible from each scope and the processes of a document.
+ * Lookups give the same result as the first match of DeclarationsWalker{positions, false}.visit_symbols.
+ * Scopes are indexed on their first lookup and stay valid for the lifetime of the snapshot.
+ */
+class SymbolIndex
+{
+    using Scope = std::unordered_map<std::string_view, UTAP::symbol_t>;
+
+    UTAP::Document& doc;
+    PositionTable& positions;
+    std::mutex mutex;
+    std::unordered_map<const UTAP::declarations_t*, Scope> scopes;
+    std::unordered_map<std::string_view, UTAP::template_t*> processes;
+
+    const Scope& get_scope(UTAP::declarations_t& decls);
+
+public:
+    explicit SymbolIndex(DocumentSnapshot& snapshot);
+
+    std::optional<UTAP::symbol_t> find(UTAP::declarations_t& decls, std::string_view name);
+    std::optional<std::reference_wrapper<UTAP::template_t>> find_process(std::string_view name) const;
+};
+
 template <class... Ts>
 struct overloaded : Ts...
 {
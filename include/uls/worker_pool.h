@@ -0,0 +1,50 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs tasks on a fixed set of threads in the order they were submitted.
+ * Tasks are tagged with the id of their request such that they can be cancelled until they start.
+ */
+class WorkerPool
+{
+    struct Task
+    {
+        nlohmann::json id;
+        std::function<void()> run;
+        std::function<void()> on_cancel;
+    };
+
+    std::mutex mutex;
+    std::condition_variable task_added;
+    std::deque<Task> tasks;
+    std::vector<std::thread> threads;
+    bool is_stopping{false};
+
+    void run_worker();
+
+public:
+    explicit WorkerPool(size_t thread_count);
+    WorkerPool(const WorkerPool&) = delete;
+
+    /** Finishes the queued tasks before joining the threads */
+    ~WorkerPool();
+
+    void submit(nlohmann::json id, std::function<void()> run, std::function<void()> on_cancel);
+
+    /** Removes the queued tasks with the given id and calls their on_cancel, returns false if there were none */
+    bool cancel(const nlohmann::json& id);
+};
+
+/**
+ * Calls task(i) for every i below count on up to max_threads threads including the calling one.
+ * The other threads come from a pool shared by all calls with one thread less than the cores of the machine.
+ * Returns once all calls are done, the first exception thrown by a task is rethrown.
+ */
+void parallel_for(size_t count, const std::function<void(size_t)>& task,
+                  size_t max_threads = std::thread::hardware_concurrency());
@@ -3,6 +3,7 @@
 #include <uls/common_data.h>
 #include <uls/declarations.h>
 #include <uls/utap_extension.h>
+#include <uls/renaming.h>
 #include <sstream>
 #include <set>
 #include <cctype>
@@ -12,6 +13,18 @@
 #include <ranges>
 #include <functional>
 #include <iterator>
+#include <numeric>
+#include <optional>
+#include <mutex>
+#include <unordered_map>
+#include <memory_resource>
+#include <span>
+#include <string_view>
+#include <bit>
+#include <limits>
+#include <tuple>
+#include <stdexcept>
+#include <cstdint>
 
 namespace ranges = std::ranges;
 
@@ -33,93 +46,181 @@ SymType sym_type(const UTAP::type_t& type)
     return SymType::unknown;
 }
 
-struct Suggestion
+constexpr std::string_view sym_type_name(SymType type)
+{
+    switch (type) {
+    case SymType::function: return "function";
+    case SymType::variable: return "variable";
+    case SymType::channel: return "channel";
+    case SymType::type: return "type";
+    case SymType::process: return "process";
+    default: return "unknown";
+    }
+}
+
+/** Keywords and builtins which are suggested independent of the model */
+struct KeywordItem
 {
-    std::string name;
+    std::string_view name;
     SymType type;
 };
 
-const auto guard_items = std::array{
-    Suggestion{"true", SymType::unknown},
-    Suggestion{"false", SymType::unknown},
+constexpr auto guard_items = std::array{
+    KeywordItem{"true", SymType::unknown},
+    KeywordItem{"false", SymType::unknown},
 };
 
-const auto queries_items = std::array{
-    Suggestion{"int", SymType::type},       Suggestion{"true", SymType::unknown},
-    Suggestion{"false", SymType::unknown},  Suggestion{"forall", SymType::unknown},
-    Suggestion{"exists", SymType::unknown},
+constexpr auto queries_items = std::array{
+    KeywordItem{"int", SymType::type},       KeywordItem{"true", SymType::unknown},
+    KeywordItem{"false", SymType::unknown},  KeywordItem{"forall", SymType::unknown},
+    KeywordItem{"exists", SymType::unknown},
 };
 
-const auto parameter_items =
-    std::array{Suggestion{"int", SymType::type},      Suggestion{"double", SymType::type},
-               Suggestion{"clock", SymType::type},    Suggestion{"chan", SymType::type},
-               Suggestion{"bool", SymType::type},     Suggestion{"broadcast", SymType::unknown},
-               Suggestion{"const", SymType::unknown}, Suggestion{"urgent", SymType::unknown}};
-
-const auto default_items = std::array{Suggestion{"int", SymType::type},       Suggestion{"double", SymType::type},
-                                      Suggestion{"clock", SymType::type},     Suggestion{"chan", SymType::type},
-                                      Suggestion{"bool", SymType::type},      Suggestion{"broadcast", SymType::unknown},
-                                      Suggestion{"const", SymType::unknown},  Suggestion{"urgent", SymType::unknown},
-                                      Suggestion{"void", SymType::unknown},   Suggestion{"meta", SymType::unknown},
-                                      Suggestion{"true", SymType::unknown},   Suggestion{"false", SymType::unknown},
-                                      Suggestion{"forall", SymType::unknown}, Suggestion{"exists", SymType::unknown},
-                                      Suggestion{"return", SymType::unknown}, Suggestion{"typedef", SymType::unknown},
-                                      Suggestion{"struct", SymType::unknown}};
-
-const auto builtin_functions = std::array{Suggestion{"abs", SymType::function},
-                                          Suggestion{"fabs", SymType::function}, Suggestion{"fmod", SymType::function},
-                                          Suggestion{"fma", SymType::function}, Suggestion{"fmax", SymType::function},
-                                          Suggestion{"fmin", SymType::function}, Suggestion{"exp", SymType::function},
-                                          Suggestion{"exp2", SymType::function}, Suggestion{"expm1", SymType::function},
-                                          Suggestion{"ln", SymType::function}, Suggestion{"log", SymType::function},
-                                          Suggestion{"log10", SymType::function}, Suggestion{"log2", SymType::function},
-                                          Suggestion{"log1p", SymType::function}, Suggestion{"pow", SymType::function},
-                                          Suggestion{"sqrt", SymType::function}, Suggestion{"cbrt", SymType::function},
-                                          Suggestion{"hypot", SymType::function}, Suggestion{"sin", SymType::function},
-                                          Suggestion{"cos", SymType::function}, Suggestion{"tan", SymType::function},
-                                          Suggestion{"asin", SymType::function}, Suggestion{"acos", SymType::function},
-                                          Suggestion{"atan", SymType::function}, Suggestion{"atan2", SymType::function},
-                                          Suggestion{"sinh", SymType::function}, Suggestion{"cosh", SymType::function},
-                                          Suggestion{"tanh", SymType::function}, Suggestion{"asinh", SymType::function},
-                                          Suggestion{"acosh", SymType::function}, Suggestion{"atanh", SymType::function},
-                                          Suggestion{"erf", SymType::function}, Suggestion{"erfc", SymType::function},
-                                          Suggestion{"tgamma", SymType::function}, Suggestion{"lgamma", SymType::function},
-                                          Suggestion{"ceil", SymType::function}, Suggestion{"floor", SymType::function},
-                                          Suggestion{"trunc", SymType::function}, Suggestion{"round", SymType::function},
-                                          Suggestion{"fint", SymType::function}, Suggestion{"ldexp", SymType::function},
-                                          Suggestion{"ilogb", SymType::function}, Suggestion{"logb", SymType::function},
-                                          Suggestion{"nextafter", SymType::function}, Suggestion{"copysign", SymType::function},
-                                          Suggestion{"signbit", SymType::function}, Suggestion{"random", SymType::function},
-                                          Suggestion{"random_normal", SymType::function}, Suggestion{"random_poisson", SymType::function},
-                                          Suggestion{"random_arcsine", SymType::function}, Suggestion{"random_beta", SymType::function},
-                                          Suggestion{"random_gamma", SymType::function}, Suggestion{"tri", SymType::function},
-                                          Suggestion{"random_weibull", SymType::function}};
+constexpr auto parameter_items =
+    std::array{KeywordItem{"int", SymType::type},      KeywordItem{"double", SymType::type},
+               KeywordItem{"clock", SymType::type},    KeywordItem{"chan", SymType::type},
+               KeywordItem{"bool", SymType::type},     KeywordItem{"broadcast", SymType::unknown},
+               KeywordItem{"const", SymType::unknown}, KeywordItem{"urgent", SymType::unknown}};
 
-template <>
-struct Serializer<SymType>
+constexpr auto default_items = std::array{
+    KeywordItem{"int", SymType::type},       KeywordItem{"double", SymType::type},
+    KeywordItem{"clock", SymType::type},     KeywordItem{"chan", SymType::type},
+    KeywordItem{"bool", SymType::type},      KeywordItem{"broadcast", SymType::unknown},
+    KeywordItem{"const", SymType::unknown},  KeywordItem{"urgent", SymType::unknown},
+    KeywordItem{"void", SymType::unknown},   KeywordItem{"meta", SymType::unknown},
+    KeywordItem{"true", SymType::unknown},   KeywordItem{"false", SymType::unknown},
+    KeywordItem{"forall", SymType::unknown}, KeywordItem{"exists", SymType::unknown},
+    KeywordItem{"return", SymType::unknown}, KeywordItem{"typedef", SymType::unknown},
+    KeywordItem{"struct", SymType::unknown},
+};
+
+constexpr KeywordItem builtin(std::string_view name) { return {name, SymType::function}; }
+
+constexpr auto builtin_functions = std::array{
+    builtin("abs"), builtin("fabs"), builtin("fmod"), builtin("fma"), builtin("fmax"), builtin("fmin"), builtin("exp"),
+    builtin("exp2"), builtin("expm1"), builtin("ln"), builtin("log"), builtin("log10"), builtin("log2"),
+    builtin("log1p"), builtin("pow"), builtin("sqrt"), builtin("cbrt"), builtin("hypot"), builtin("sin"),
+    builtin("cos"), builtin("tan"), builtin("asin"), builtin("acos"), builtin("atan"), builtin("atan2"),
+    builtin("sinh"), builtin("cosh"), builtin("tanh"), builtin("asinh"), builtin("acosh"), builtin("atanh"),
+    builtin("erf"), builtin("erfc"), builtin("tgamma"), builtin("lgamma"), builtin("ceil"), builtin("floor"),
+    builtin("trunc"), builtin("round"), builtin("fint"), builtin("ldexp"), builtin("ilogb"), builtin("logb"),
+    builtin("nextafter"), builtin("copysign"), builtin("signbit"), builtin("random"), builtin("random_normal"),
+    builtin("random_poisson"), builtin("random_arcsine"), builtin("random_beta"), builtin("random_gamma"),
+    builtin("tri"), builtin("random_weibull"),
+};
+
+/** The completion JSON of every item in table, built the first time the table is suggested */
+template <const auto& table>
+std::span<const nlohmann::json> serialized_table()
 {
-    static nlohmann::json serialize(const SymType& type)
-    {
-        switch (type) {
-        case SymType::function: return "function";
-        case SymType::variable: return "variable";
-        case SymType::channel: return "channel";
-        case SymType::type: return "type";
-        case SymType::process: return "process";
-        default: return "unknown";
-        }
+    static const auto items = [] {
+        auto result = std::array<nlohmann::json, std::size(table)>{};
+        for (size_t i = 0; i < std::size(table); ++i)
+            result[i] = {{"name", table[i].name}, {"type", sym_type_name(table[i].type)}};
+        return result;
+    }();
+    return items;
+}
+
+struct KeywordTable
+{
+    std::span<const KeywordItem> items;
+    std::span<const nlohmann::json> (*serialized)();
+};
+
+template <const auto& table>
+constexpr auto keyword_table = KeywordTable{table, serialized_table<table>};
+
+/** Which kind of text an xpath refers to, decides the keywords and symbol types that are suggested */
+enum class LabelKind : uint8_t {
+    declaration,
+    parameter,
+    invariant,
+    exponential_rate,
+    select,
+    guard,
+    synchronisation,
+    assignment,
+    queries,
+    system
+};
+
+LabelKind classify_xpath(std::string_view xpath)
+{
+    if (xpath == "/nta/queries!")
+        return LabelKind::queries;
+    if (xpath == "/nta/system!")
+        return LabelKind::system;
+    if (xpath.ends_with("/parameter!"))
+        return LabelKind::parameter;
+    if (!xpath.ends_with("\"]"))
+        return LabelKind::declaration;
+
+    constexpr auto labels = std::array{
+        std::pair{std::string_view{"label[@kind=\"invariant\"]"}, LabelKind::invariant},
+        std::pair{std::string_view{"label[@kind=\"exponentialrate\"]"}, LabelKind::exponential_rate},
+        std::pair{std::string_view{"label[@kind=\"select\"]"}, LabelKind::select},
+        std::pair{std::string_view{"label[@kind=\"guard\"]"}, LabelKind::guard},
+        std::pair{std::string_view{"label[@kind=\"synchronisation\"]"}, LabelKind::synchronisation},
+        std::pair{std::string_view{"label[@kind=\"assignment\"]"}, LabelKind::assignment},
+    };
+    for (const auto& [suffix, kind] : labels) {
+        if (xpath.ends_with(suffix))
+            return kind;
     }
+    return LabelKind::declaration;
+}
+
+struct LabelContext
+{
+    uint8_t ignored_mask;  // Symbol types that cannot appear in the label
+    KeywordTable keywords;
+    bool with_builtins;
+};
+
+constexpr uint8_t only(uint8_t types) { return static_cast<uint8_t>(~types); }
+
+/** Indexed by LabelKind */
+constexpr auto label_contexts = std::array{
+    LabelContext{0, keyword_table<default_items>, true},
+    LabelContext{only(SymType::type), keyword_table<parameter_items>, false},
+    LabelContext{only(SymType::variable | SymType::function), keyword_table<default_items>, true},
+    LabelContext{only(SymType::variable), keyword_table<default_items>, true},
+    LabelContext{only(SymType::type), keyword_table<default_items>, true},
+    LabelContext{only(SymType::variable | SymType::function), keyword_table<guard_items>, true},
+    LabelContext{only(SymType::channel), keyword_table<default_items>, true},
+    LabelContext{only(SymType::variable | SymType::function), keyword_table<default_items>, true},
+    LabelContext{0, keyword_table<queries_items>, true},
+    LabelContext{0, keyword_table<default_items>, true},
+};
+static_assert(label_contexts.size() == static_cast<size_t>(LabelKind::system) + 1);
+
+struct Suggestion
+{
+    std::pmr::string name;
+    SymType type;
+    const nlohmann::json* serialized{nullptr};  // Set for keywords whose JSON is built once
+};
+
+/** Suggestions allocated in the arena of their request, the arena is released once they are serialized */
+struct Completions
+{
+    std::unique_ptr<RequestArena> arena;
+    std::pmr::vector<Suggestion> items;
 };
 
 template <>
-struct Serializer<std::vector<Suggestion>>
+struct Serializer<Completions>
 {
-    static nlohmann::json serialize(const std::vector<Suggestion>& items)
+    static nlohmann::json serialize(const Completions& completions)
     {
-        nlohmann::json json_array;
-        for (const Suggestion& item : items) {
-            json_array.push_back(
-                nlohmann::json{{"name", item.name}, {"type", Serializer<SymType>::serialize(item.type)}});
+        nlohmann::json::array_t json_array;
+        json_array.reserve(completions.items.size());
+        for (const Suggestion& item : completions.items) {
+            if (item.serialized != nullptr)
+                json_array.push_back(*item.serialized);
+            else
+                json_array.push_back(nlohmann::json{{"name", item.name}, {"type", sym_type_name(item.type)}});
         }
         return json_array;
     }
@@ -140,32 +241,348 @@ bool is_name_autogenerated(std::string_view name)
     return name.substr(0, 3) == "_id" && ranges::all_of(name.substr(3), is_digit);
 }
 
+/** Weights of the fuzzy match, a typed prefix of the name gets the start and consecutive bonuses for every character */
+constexpr int start_bonus = 16;
+constexpr int boundary_bonus = 8;  // Matches the first character of a word in snake_case, camelCase or after digits
+constexpr int consecutive_bonus = 6;
+constexpr int case_bonus = 1;
+constexpr int gap_penalty = 1;  // For each skipped character of the name
+constexpr size_t max_fuzzy_length = 64;  // Longer names are only matched on their first characters
+
+char to_lower(char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); }
+
+bool is_word_start(std::string_view name, size_t i)
+{
+    if (i == 0)
+        return true;
+    auto c = static_cast<unsigned char>(name[i]);
+    auto previous = static_cast<unsigned char>(name[i - 1]);
+    return previous == '_' || previous == '.' || (std::isupper(c) && std::islower(previous)) ||
+           (std::isdigit(c) != 0) != (std::isdigit(previous) != 0);
+}
+
+/**
+ * Scores the best match of pattern as a case insensitive subsequence of name, empty if it is not a subsequence.
+ * Prefixes score highest followed by matches at word starts such that "gC" finds globalClock.
+ */
+std::optional<int> fuzzy_score(std::string_view name, std::string_view pattern)
+{
+    name = name.substr(0, max_fuzzy_length);
+    if (pattern.empty())
+        return 0;
+    if (pattern.size() > name.size())
+        return std::nullopt;
+
+    // Rejects most names before scoring
+    auto rest = name;
+    for (char c : pattern) {
+        auto found = ranges::find(rest, to_lower(c), to_lower);
+        if (found == rest.end())
+            return std::nullopt;
+        rest = rest.substr(static_cast<size_t>(found - rest.begin()) + 1);
+    }
+
+    // best[j] is the best score of the typed characters so far with the last one matched at name[j]
+    constexpr int no_match = std::numeric_limits<int>::min() / 2;
+    auto best = std::array<int, max_fuzzy_length>{};
+    auto next = std::array<int, max_fuzzy_length>{};
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        int gapped = no_match;  // Best score of an earlier match followed by skipped characters up to j
+        for (size_t j = 0; j < name.size(); ++j) {
+            if (j >= 2 && i > 0)
+                gapped = std::max(gapped, best[j - 2]) - gap_penalty;
+
+            int previous = no_match;
+            if (i == 0)
+                previous = -gap_penalty * static_cast<int>(j);
+            else if (j > 0)
+                previous = best[j - 1] > no_match ? std::max(best[j - 1] + consecutive_bonus, gapped) : gapped;
+
+            if (previous <= no_match || to_lower(name[j]) != to_lower(pattern[i])) {
+                next[j] = no_match;
+                continue;
+            }
+            int bonus = j == 0 ? start_bonus : is_word_start(name, j) ? boundary_bonus : 0;
+            next[j] = previous + bonus + (name[j] == pattern[i] ? case_bonus : 0);
+        }
+        std::swap(best, next);
+    }
+    return *std::max_element(best.begin(), best.begin() + static_cast<ptrdiff_t>(name.size()));
+}
+
+/** What besides the typed text makes a suggestion likely, symbols in closer scopes and those used often rank higher */
+struct Relevance
+{
+    uint8_t proximity{0};  // 2 for the scope itself, 1 for its parent and 0 for further scopes and keywords
+    uint32_t usages{0};
+};
+
+constexpr int proximity_weight = 4;
+constexpr int max_usage_bonus = 4;
+
+int rank_score(int match, const Relevance& relevance)
+{
+    int usage_bonus = std::min(static_cast<int>(std::bit_width(relevance.usages)), max_usage_bonus);
+    return match + proximity_weight * relevance.proximity + usage_bonus;
+}
+
+struct CompletionRequest
+{
+    Identifier id;
+    std::optional<size_t> limit;  // Only return the best matches of the typed identifier
+};
+
+template <>
+struct Deserializer<CompletionRequest>
+{
+    static CompletionRequest deserialize(const nlohmann::json& message)
+    {
+        auto request = CompletionRequest{Deserializer<Identifier>::deserialize(message), std::nullopt};
+        if (auto it = message.find("limit"); it != message.end()) {
+            if (!it->is_number_integer() || it->get<int64_t>() <= 0)
+                throw std::invalid_argument{"The limit must be a positive integer"};
+            request.limit = it->get<size_t>();
+        }
+        return request;
+    }
+};
+
+/** The symbols visible from a scope in walk order together with a by name ordering for prefix queries */
+struct ScopeSymbols
+{
+    struct Entry
+    {
+        std::string_view name;
+        SymType type;
+        uint32_t offset;
+        bool is_local;  // Local symbols are only visible after their declaration
+        uint8_t proximity;  // See Relevance
+    };
+
+    std::vector<Entry> entries;
+    std::vector<UTAP::symbol_t> entry_symbols;  // Symbol of each entry
+    std::optional<std::vector<uint32_t>> usage_counts;  // Of each entry, counted on the first ranked completion
+    std::vector<uint32_t> by_name;  // Indices into entries sorted by name, ties keep walk order
+    std::vector<uint32_t> local_offsets;  // Sorted offsets of the local entries
+
+    bool is_visible(const Entry& entry, uint32_t offset) const { return !entry.is_local || entry.offset < offset; }
+
+    /** Offsets with the same partition see the same entries */
+    uint32_t visibility_partition(uint32_t offset) const
+    {
+        return static_cast<uint32_t>(ranges::lower_bound(local_offsets, offset) - local_offsets.begin());
+    }
+};
+
+/** The entries of a scope that pass the filters of a completion, both in walk order and sorted by name */
+struct VisibleSymbols
+{
+    std::vector<uint32_t> in_walk_order;
+    std::vector<uint32_t> by_name;
+};
+
+struct VisibilityKey
+{
+    const UTAP::declarations_t* scope;
+    uint32_t partition;
+    uint8_t ignored_mask;
+    bool use_templates;
+
+    bool operator==(const VisibilityKey&) const = default;
+};
+
+struct VisibilityKeyHash
+{
+    size_t operator()(const VisibilityKey& key) const
+    {
+        size_t fields = size_t{key.partition} << 10 | size_t{key.ignored_mask} << 1 | size_t{key.use_templates};
+        return std::hash<const void*>{}(key.scope) ^ fields * 0x9e3779b97f4a7c15;
+    }
+};
+
+/** Symbols of every scope used for completion, scopes are collected on their first request */
+class CompletionIndex
+{
+    DocumentSnapshot& snapshot;
+    PositionTable& positions;
+    std::mutex mutex;
+    std::unordered_map<const UTAP::declarations_t*, ScopeSymbols> scopes;
+    std::unordered_map<VisibilityKey, VisibleSymbols, VisibilityKeyHash> visible;
+
+    ScopeSymbols& collect_scope(UTAP::declarations_t& decls)
+    {
+        auto lock = std::lock_guard{mutex};
+        auto [it, is_new] = scopes.try_emplace(&decls);
+        if (!is_new)
+            return it->second;
+
+        ScopeSymbols& symbols = it->second;
+        DeclarationsWalker{positions, false}.visit_symbols(decls, [&](UTAP::symbol_t& symbol, const TextRange& range) {
+            SymType type = is_template(symbol) ? SymType::process : sym_type(symbol.get_type());
+            uint8_t distance = 0;
+            for (UTAP::frame_t frame = decls.frame; !(frame == symbol.get_frame()) && frame.has_parent();
+                 frame = frame.get_parent())
+                ++distance;
+            auto proximity = static_cast<uint8_t>(distance < 2 ? 2 - distance : 0);
+            symbols.entries.push_back(
+                {symbol.get_name(), type, range.begOffset, symbol.get_frame() == decls.frame, proximity});
+            symbols.entry_symbols.push_back(symbol);
+            return false;
+        });
+
+        symbols.by_name.resize(symbols.entries.size());
+        std::iota(symbols.by_name.begin(), symbols.by_name.end(), 0);
+        ranges::stable_sort(symbols.by_name, {}, [&](uint32_t i) { return symbols.entries[i].name; });
+        for (const ScopeSymbols::Entry& entry : symbols.entries) {
+            if (entry.is_local)
+                symbols.local_offsets.push_back(entry.offset);
+        }
+        ranges::sort(symbols.local_offsets);
+        return symbols;
+    }
+
+public:
+    explicit CompletionIndex(DocumentSnapshot& snapshot): snapshot{snapshot}, positions{snapshot.get<PositionTable>()}
+    {}
+
+    const ScopeSymbols& get_scope(UTAP::declarations_t& decls) { return collect_scope(decls); }
+
+    /** How often the symbol of each entry of the scope is used in the document */
+    const std::vector<uint32_t>& get_usage_counts(UTAP::declarations_t& decls)
+    {
+        ScopeSymbols& symbols = collect_scope(decls);
+        // Built before locking as the index walks the whole document
+        const UsageIndex& usages = snapshot.get<UsageIndex>();
+
+        auto lock = std::lock_guard{mutex};
+        if (!symbols.usage_counts) {
+            auto& counts = symbols.usage_counts.emplace();
+            counts.reserve(symbols.entry_symbols.size());
+            for (const UTAP::symbol_t& symbol : symbols.entry_symbols)
+                counts.push_back(static_cast<uint32_t>(usages.find(symbol).size()));
+        }
+        return *symbols.usage_counts;
+    }
+
+    /**
+     * Entries of the scope visible at offset that are not ignored, templates are only kept if use_templates is set.
+     * Cached per visibility partition such that repeated completions in the same label reuse the result.
+     */
+    const VisibleSymbols& get_visible(UTAP::declarations_t& decls, uint32_t offset, uint8_t ignored_mask,
+                                      bool use_templates)
+    {
+        const ScopeSymbols& symbols = get_scope(decls);
+        auto key = VisibilityKey{&decls, symbols.visibility_partition(offset), ignored_mask, use_templates};
+
+        auto lock = std::lock_guard{mutex};
+        auto [it, is_new] = visible.try_emplace(key);
+        if (!is_new)
+            return it->second;
+
+        auto is_wanted = [&](uint32_t i) {
+            const ScopeSymbols::Entry& entry = symbols.entries[i];
+            return symbols.is_visible(entry, offset) && (ignored_mask & entry.type) == 0U &&
+                   (entry.type != SymType::process || use_templates);
+        };
+        VisibleSymbols& result = it->second;
+        for (uint32_t i = 0; i < symbols.entries.size(); ++i) {
+            if (is_wanted(i))
+                result.in_walk_order.push_back(i);
+        }
+        ranges::copy_if(symbols.by_name, std::back_inserter(result.by_name), is_wanted);
+        return result;
+    }
+};
+
 class ResultBuilder
 {
-    std::vector<Suggestion> items;
-    std::string prefix;
-    uint8_t type_filter_mask;
-
-    // Takes stl containers of Suggestions
-    void add_items(const auto& ... container) { 
-        auto type_check = [filter=type_filter_mask](const Suggestion& s) { return (filter & s.type) == 0U; };
-        (ranges::copy_if(container, std::back_inserter(items), type_check), ...); 
+    /** A suggestion kept among the best ones of a ranked completion */
+    struct Ranked
+    {
+        Suggestion suggestion;
+        int score;
+    };
+
+    std::pmr::memory_resource* memory;
+    std::pmr::vector<Suggestion> items;
+    std::pmr::string prefix;
+    std::optional<size_t> limit;  // Set when ranking
+    std::string_view typed;
+    std::pmr::vector<Ranked> ranked;  // Heap of the best suggestions with the worst one in front
+    uint8_t type_filter_mask{0};
+
+    /** Higher scores first, shorter names are closer to what has been typed */
+    static bool is_better(int score, std::string_view name, const Ranked& other, size_t prefix_size)
+    {
+        auto other_name = std::string_view{other.suggestion.name}.substr(prefix_size);
+        return std::tuple{-score, name.size(), name} < std::tuple{-other.score, other_name.size(), other_name};
+    }
+
+    /** Orders ranked items best first */
+    auto rank_order() const
+    {
+        return [size = prefix.size()](const Ranked& a, const Ranked& b) {
+            return is_better(a.score, std::string_view{a.suggestion.name}.substr(size), b, size);
+        };
+    }
+
+    /** Keeps the item if it is among the best limit items seen so far, only then is its name copied */
+    void offer(std::string_view name, SymType type, const nlohmann::json* serialized, const Relevance& relevance)
+    {
+        std::optional<int> match = fuzzy_score(name, typed.substr(std::min(prefix.size(), typed.size())));
+        if (!match)
+            return;
+        int total = rank_score(*match, relevance);
+        if (ranked.size() == *limit) {
+            if (ranked.empty() || !is_better(total, name, ranked.front(), prefix.size()))
+                return;
+            ranges::pop_heap(ranked, rank_order());
+            ranked.pop_back();
+        }
+        auto item = std::pmr::string{prefix, memory};
+        item.append(name);
+        ranked.push_back({{std::move(item), type, serialized}, total});
+        ranges::push_heap(ranked, rank_order());
+    }
+
+    void add_keywords(const KeywordTable& table)
+    {
+        std::span<const nlohmann::json> serialized = table.serialized();
+        for (size_t i = 0; i < table.items.size(); ++i) {
+            const KeywordItem& keyword = table.items[i];
+            if ((type_filter_mask & keyword.type) != 0U)
+                continue;
+            if (limit)
+                offer(keyword.name, keyword.type, &serialized[i], {});
+            else
+                items.push_back({std::pmr::string{keyword.name, memory}, keyword.type, &serialized[i]});
+        }
     }
 
 public:
+    explicit ResultBuilder(std::pmr::memory_resource* memory):
+        memory{memory}, items{memory}, prefix{memory}, ranked{memory}
+    {}
+
     void set_ignored_mask(uint8_t ignore_mask) { type_filter_mask = ignore_mask; }
-    void add_defaults(std::string_view xpath)
+    uint8_t get_ignored_mask() const { return type_filter_mask; }
+    /**
+     * Only keep the best max_items items that fuzzy match the typed text after the prefix.
+     * The text must outlive the builder.
+     */
+    void rank_by(std::string_view text, size_t max_items)
+    {
+        typed = text;
+        limit = max_items;  // Not reserved up front, the limit may be far larger than the number of candidates
+    }
+    /** Adds the keywords of the label, must be called before a prefix is set */
+    void add_defaults(const LabelContext& context)
     {
-        if (xpath.ends_with("/queries!"))
-            add_items(queries_items, builtin_functions);
-        else if (xpath.ends_with("/parameter!"))
-            add_items(parameter_items);
-        else if (xpath.ends_with("label[@kind=\"guard\"]"))
-            add_items(guard_items, builtin_functions);
-        else
-            add_items(default_items, builtin_functions);
+        add_keywords(context.keywords);
+        if (context.with_builtins)
+            add_keywords(keyword_table<builtin_functions>);
     }
-    void set_prefix(std::string new_prefix) { prefix = std::move(new_prefix); }
+    void set_prefix(std::string_view new_prefix) { prefix.assign(new_prefix); }
     void add_struct(const UTAP::type_t& type)
     {
         if (type.size() == 0)
@@ -176,65 +593,79 @@ public:
         }
 
         for (size_t i = 0; i < type.size(); i++) {
-            add_item(prefix + type.get_label(i), SymType::variable);
+            add_item(type.get_label(i), SymType::variable);
         }
     }
 
     void add_template(const UTAP::template_t& templ)
     {
         for (const UTAP::variable_t& var : templ.variables) {
-            add_item(prefix + var.uid.get_name(), SymType::variable);
+            add_item(var.uid.get_name(), SymType::variable);
         }
         for (const UTAP::function_t& func : templ.functions) {
-            add_item(prefix + func.uid.get_name(), SymType::function);
+            add_item(func.uid.get_name(), SymType::function);
         }
         for (const UTAP::location_t& loc : templ.locations) {
             std::string_view name = loc.uid.get_name();
             if (!is_name_autogenerated(name))
-                add_item(std::string{prefix}.append(name), SymType::unknown);
+                add_item(name, SymType::unknown);
         }
     }
 
-    void add_item(std::string item, SymType type)
+    /** Adds the name after the current prefix */
+    void add_item(std::string_view name, SymType type, const Relevance& relevance = {})
     {
-        if ((type_filter_mask & type) == 0U)
-            items.emplace_back(std::move(item), type);
+        if ((type_filter_mask & type) != 0U)
+            return;
+        if (limit) {
+            offer(name, type, nullptr, relevance);
+            return;
+        }
+        auto item = std::pmr::string{prefix, memory};
+        item.append(name);
+        items.push_back({std::move(item), type});
     }
 
-    std::vector<Suggestion>& get_items() { return items; }
+    /** The items in the order they were added, or the best ones first when ranking */
+    std::pmr::vector<Suggestion>& get_items()
+    {
+        if (!limit)
+            return items;
+        ranges::sort_heap(ranked, rank_order());
+        items.clear();
+        items.reserve(ranked.size());
+        for (Ranked& item : ranked)
+            items.push_back(std::move(item.suggestion));
+        return items;
+    }
 };
 
 void AutocompleteModule::configure(Server& server)
 {
-    server.add_command<Identifier>("autocomplete", [this](const Identifier& id) -> std::vector<Suggestion> {
-        auto results = ResultBuilder{};
-
-        if (id.xpath.ends_with("/parameter!"))
-            results.set_ignored_mask(~SymType::type);
-        else if (id.xpath.ends_with("label[@kind=\"invariant\"]"))
-            results.set_ignored_mask(~(SymType::variable | SymType::function));
-        else if (id.xpath.ends_with("label[@kind=\"exponentialrate\"]"))
-            results.set_ignored_mask(~SymType::variable);
-        else if (id.xpath.ends_with("label[@kind=\"select\"]"))
-            results.set_ignored_mask(~SymType::type);
-        else if (id.xpath.ends_with("label[@kind=\"guard\"]"))
-            results.set_ignored_mask(~(SymType::variable | SymType::function));
-        else if (id.xpath.ends_with("label[@kind=\"synchronisation\"]"))
-            results.set_ignored_mask(~SymType::channel);
-        else if (id.xpath.ends_with("label[@kind=\"assignment\"]"))
-            results.set_ignored_mask(~(SymType::variable | SymType::function));
-
-        bool is_query = id.xpath == "/nta/queries!";
-        UTAP::Document& doc = doc_repo.get_document();
-        UTAP::declarations_t& decls = navigate_xpath(doc, id.xpath, id.offset);
+    server.add_read_only_command<CompletionRequest>("autocomplete", [this](const CompletionRequest& request)
+                                                                        -> Completions {
+        const Identifier& id = request.id;
+        auto arena = std::make_unique<RequestArena>();
+        auto results = ResultBuilder{arena->get()};
+        if (request.limit)
+            results.rank_by(id.identifier, *request.limit);
+
+        LabelKind kind = classify_xpath(id.xpath);
+        const LabelContext& context = label_contexts[static_cast<size_t>(kind)];
+        results.set_ignored_mask(context.ignored_mask);
+
+        bool is_query = kind == LabelKind::queries;
+        auto snapshot = doc_repo.get_snapshot();
+        UTAP::declarations_t& decls = navigate_xpath(*snapshot, id.xpath, id.offset);
 
         auto offset = id.identifier.find_last_of('.');
         if (offset != std::string::npos) {
-            if (std::optional<UtapEntity> entity = find_declaration(doc, decls, id.identifier.substr(0, offset))) {
-                results.set_prefix(id.identifier.substr(0, offset + 1));
+            auto identifier = std::string_view{id.identifier};
+            if (std::optional<UtapEntity> entity = find_declaration(*snapshot, decls, identifier.substr(0, offset))) {
+                results.set_prefix(identifier.substr(0, offset + 1));
                 std::visit(overloaded{[&](UTAP::symbol_t& sym) {
                                         if (is_template(sym) && is_query){
-                                            if(auto process = find_process(doc, sym.get_name()))
+                                            if(auto process = find_process(*snapshot, sym.get_name()))
                                                 results.add_template(*process);
                                         } else if (is_struct(sym))
                                             results.add_struct(sym.get_type().get(0));
@@ -243,20 +674,30 @@ void AutocompleteModule::configure(Server& server)
                            *entity);
             }
         } else {
-            results.add_defaults(id.xpath);
-            bool use_templates = is_query || id.xpath == "/nta/system!";
-            DeclarationsWalker{doc, false}.visit_symbols(decls, [&](UTAP::symbol_t& symbol, const TextRange& range) {
-                bool is_symbol_visible = symbol.get_frame() != decls.frame || range.begOffset < id.offset;
-                if (is_symbol_visible) {
-                    if (!is_template(symbol))
-                        results.add_item(symbol.get_name(), sym_type(symbol.get_type()));
-                    else if (use_templates)
-                        results.add_item(symbol.get_name(), SymType::process);
+            results.add_defaults(context);
+            bool use_templates = is_query || kind == LabelKind::system;
+            auto& index = snapshot->get<CompletionIndex>();
+            const ScopeSymbols& symbols = index.get_scope(decls);
+            const VisibleSymbols& visible =
+                index.get_visible(decls, id.offset, results.get_ignored_mask(), use_templates);
+
+            if (request.limit) {
+                const std::vector<uint32_t>& usages = index.get_usage_counts(decls);
+                // Only the innermost of equally named symbols is suggested
+                std::string_view previous_name;
+                for (uint32_t i : visible.by_name) {
+                    const ScopeSymbols::Entry& entry = symbols.entries[i];
+                    if (entry.name != previous_name) {
+                        results.add_item(entry.name, entry.type, {entry.proximity, usages[i]});
+                        previous_name = entry.name;
+                    }
                 }
-                return false;
-            });
+            } else {
+                for (uint32_t i : visible.in_walk_order)
+                    results.add_item(symbols.entries[i].name, symbols.entries[i].type);
+            }
         }
 
-        return std::move(results.get_items());
+        return {std::move(arena), std::move(results.get_items())};
     });
 }
\ No newline at end of file
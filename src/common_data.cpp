@@ -1,6 +1,9 @@
 #include <uls/common_data.h>
+#include <uls/system.h>
 #include <nlohmann/json.hpp>
 #include <utap/document.h>
+#include <cstddef>
+#include <utility>
 
 Identifier Deserializer<Identifier>::deserialize(const nlohmann::json& message)
 {
@@ -18,9 +21,43 @@ nlohmann::json Serializer<TextRange>::serialize(const TextRange& range)
     return {{"start", range.begOffset}, {"end", range.endOffset}};
 }
 
-TextRange::TextRange(const UTAP::Document& doc, const UTAP::position_t& symbol)
+constexpr size_t thread_buffer_size = 64 * 1024;
+thread_local bool is_thread_buffer_used = false;
+
+std::byte* thread_buffer()
+{
+    thread_local auto buffer = std::make_unique<std::byte[]>(thread_buffer_size);
+    return buffer.get();
+}
+
+RequestArena::RequestArena():
+    owns_thread_buffer{!std::exchange(is_thread_buffer_used, true)},
+    resource{owns_thread_buffer ? std::pmr::monotonic_buffer_resource{thread_buffer(), thread_buffer_size}
+                                : std::pmr::monotonic_buffer_resource{}}
+{}
+
+RequestArena::~RequestArena()
+{
+    resource.release();
+    if (owns_thread_buffer)
+        is_thread_buffer_used = false;
+}
+
+PositionTable::PositionTable(DocumentSnapshot& snapshot): doc{snapshot.get_document()} {}
+
+const PositionTable::Line& PositionTable::find_node_start(uint32_t position)
+{
+    const auto& line = doc.find_position(position);
+    auto lock = std::lock_guard{mutex};
+    auto it = node_starts.find(line.path.get());
+    if (it == node_starts.end())
+        it = node_starts.emplace(line.path.get(), doc.find_first_position(position)).first;
+    return it->second;
+}
+
+TextRange::TextRange(PositionTable& positions, const UTAP::position_t& symbol)
 {
-    auto doc_start = doc.find_first_position(symbol.start);
+    const auto& doc_start = positions.find_node_start(symbol.start);
 
     begOffset = symbol.start - doc_start.position;
     endOffset = symbol.end - doc_start.position;
@@ -33,9 +70,9 @@ TextRange& TextRange::intersect(const TextRange& other)
     return *this;
 }
 
-TextRange TextRange::from(const UTAP::Document& doc, const UTAP::position_t& symbol)
+TextRange TextRange::from(PositionTable& positions, const UTAP::position_t& symbol)
 {
-    auto doc_start = doc.find_first_position(symbol.start);
+    const auto& doc_start = positions.find_node_start(symbol.start);
     uint32_t start = symbol.start - doc_start.position;
     uint32_t end = std::numeric_limits<int32_t>::max();
     return {start, end};
@@ -43,11 +80,11 @@ TextRange TextRange::from(const UTAP::Document& doc, const UTAP::position_t& sym
 
 bool TextRange::contains(uint32_t offset) { return begOffset <= offset && offset <= endOffset; }
 
-TextLocation::TextLocation(UTAP::Document& doc, const UTAP::position_t& pos)
+TextLocation::TextLocation(PositionTable& positions, const UTAP::position_t& pos)
 {
-    auto doc_start = doc.find_first_position(pos.start);
+    const auto& doc_start = positions.find_node_start(pos.start);
 
-    path = doc_start.path;
+    path = doc_start.path.get();
     range.begOffset = pos.start - doc_start.position;
     range.endOffset = pos.end - doc_start.position;
 }
\ No newline at end of file
@@ -18,17 +18,11 @@ struct Sym
     Sym(UTAP::type_t type, UTAP::position_t position): type{std::move(type)}, position{position} {}
 };
 
-std::optional<Sym> find_symbol(UTAP::Document& doc, UTAP::declarations_t& decls, std::string_view name)
+std::optional<Sym> find_symbol(DocumentSnapshot& snapshot, UTAP::declarations_t& decls, std::string_view name)
 {
-    std::optional<Sym> result{};
-    DeclarationsWalker{doc, false}.visit_symbols(decls, [&](const UTAP::symbol_t& symbol, const TextRange&) {
-        if (!result.has_value() && symbol.get_name() == name) {
-            result = std::make_optional<Sym>(Sym{symbol});
-            return true;  // Terminate early
-        }
-        return false;
-    });
-    return result;
+    if (std::optional<UTAP::symbol_t> symbol = snapshot.get<SymbolIndex>().find(decls, name))
+        return std::make_optional<Sym>(Sym{*symbol});
+    return std::nullopt;
 }
 
 class DotSeparator
@@ -71,24 +65,25 @@ class SymFinder
 {
 public:
     using SymbolSource = std::variant<UTAP::declarations_t*, UTAP::type_t>;
-    SymFinder(UTAP::Document& doc, UTAP::declarations_t& source): doc{doc}, symbol_source{&source} {}
+    SymFinder(DocumentSnapshot& snapshot, UTAP::declarations_t& source): snapshot{snapshot}, symbol_source{&source}
+    {}
     void set_source(SymbolSource source) { symbol_source = std::move(source); }
 
     std::optional<Sym> find(std::string_view name)
     {
-        return std::visit(overloaded{[&, this](UTAP::declarations_t* decls) { return find_symbol(doc, *decls, name); },
+        return std::visit(overloaded{[&, this](UTAP::declarations_t* decls) { return find_symbol(snapshot, *decls, name); },
                                      [&name](UTAP::type_t struct_type) { return find_symbol(struct_type, name); }},
                           symbol_source);
     }
 
 private:
-    UTAP::Document& doc;
+    DocumentSnapshot& snapshot;
     SymbolSource symbol_source;
 };
 
-std::optional<Sym> find_sym(UTAP::Document& doc, UTAP::declarations_t& decls, std::string_view id)
+std::optional<Sym> find_sym(DocumentSnapshot& snapshot, UTAP::declarations_t& decls, std::string_view id)
 {
-    SymFinder finder{doc, decls};
+    SymFinder finder{snapshot, decls};
     auto name_it = DotSeparator{id};
     auto label = name_it.next();
     while (name_it.has_next()) {
@@ -97,7 +92,7 @@ std::optional<Sym> find_sym(UTAP::Document& doc, UTAP::declarations_t& decls, st
             if (struct_symbol->type.is_constant())
                 finder.set_source(struct_symbol->type.get(0).get(0));
             else if (struct_symbol->type.is(UTAP::Constants::INSTANCE)){
-                if(auto opt_process = find_process(doc, label))
+                if(auto opt_process = find_process(snapshot, label))
                     finder.set_source(&static_cast<UTAP::template_t&>(*opt_process));
             } else
                 finder.set_source(struct_symbol->type.get(0));
@@ -111,16 +106,16 @@ std::optional<Sym> find_sym(UTAP::Document& doc, UTAP::declarations_t& decls, st
     return finder.find(label);
 }
 
-std::optional<Sym> find_sym(UTAP::Document& doc, const Identifier& id)
+std::optional<Sym> find_sym(DocumentSnapshot& snapshot, const Identifier& id)
 {
-    UTAP::declarations_t& decls = navigate_xpath(doc, id.xpath, id.offset);
-    return find_sym(doc, decls, id.identifier);
+    UTAP::declarations_t& decls = navigate_xpath(snapshot, id.xpath, id.offset);
+    return find_sym(snapshot, decls, id.identifier);
 }
 
-std::optional<UtapEntity> find_declaration(UTAP::Document& doc, UTAP::declarations_t& decls,
+std::optional<UtapEntity> find_declaration(DocumentSnapshot& snapshot, UTAP::declarations_t& decls,
                                            std::string_view identifier)
 {
-    if (std::optional<Sym> sym = find_sym(doc, decls, identifier)) {
+    if (std::optional<Sym> sym = find_sym(snapshot, decls, identifier)) {
         if (sym->symbol != UTAP::symbol_t{})
             return std::make_optional(sym->symbol);
         else
@@ -130,19 +125,19 @@ std::optional<UtapEntity> find_declaration(UTAP::Document& doc, UTAP::declaratio
     return std::nullopt;
 }
 
-std::optional<TextLocation> find_goto_result(UTAP::Document& doc, const Identifier& params)
+std::optional<TextLocation> find_goto_result(DocumentSnapshot& snapshot, const Identifier& params)
 {
-    if (std::optional<Sym> symbol = find_sym(doc, params))
-        return std::make_optional(TextLocation{doc, symbol->position});
+    if (std::optional<Sym> symbol = find_sym(snapshot, params))
+        return std::make_optional(TextLocation{snapshot.get<PositionTable>(), symbol->position});
     else
         return std::nullopt;
 }
 
 nlohmann::json find(SystemRepository& doc_repo, const Identifier& params)
 {
-    UTAP::Document& doc = doc_repo.get_document();
+    auto snapshot = doc_repo.get_snapshot();
 
-    auto result_opt = find_goto_result(doc, params);
+    auto result_opt = find_goto_result(*snapshot, params);
 
     // TODO use exceptions instead
     if (result_opt.has_value() &&
@@ -154,5 +149,5 @@ nlohmann::json find(SystemRepository& doc_repo, const Identifier& params)
 
 void DeclarationsModule::configure(Server& server)
 {
-    server.add_command<Identifier>("goto_decl", [this](const Identifier& params) { return find(doc, params); });
+    server.add_read_only_command<Identifier>("goto_decl", [this](const Identifier& params) { return find(doc, params); });
 }
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include <uls/diagnostics.h>
+#include <uls/server.h>
+#include <uls/common_data.h>
+#include <utap/utap.h>
+#include <exception>
+#include <string_view>
+#include <vector>
+
+using json = nlohmann::json;
+
+/** The diagnostics of a snapshot grouped by the xpath of the node they occur in */
+std::unordered_map<std::string, json> collect_diagnostics(DocumentSnapshot& snapshot)
+{
+    auto& positions = snapshot.get<PositionTable>();
+    std::unordered_map<std::string, json> diagnostics;
+    auto add_all = [&](const std::vector<UTAP::error_t>& errors, std::string_view severity) {
+        for (const UTAP::error_t& error : errors) {
+            auto xpath = std::string{"/nta"};
+            auto range = TextRange{0, 0};
+            try {
+                auto location = TextLocation{positions, error.position};
+                xpath = *location.path;
+                range = location.range;
+            } catch (std::exception&) {
+                // Errors without a position in the model, e.g. about the document as a whole, belong to "/nta"
+            }
+            auto& node = diagnostics[xpath];
+            if (node.is_null())
+                node = json::array();
+            node.push_back({{"start", range.begOffset},
+                            {"end", range.endOffset},
+                            {"severity", severity},
+                            {"message", error.msg},
+                            {"context", error.context}});
+        }
+    };
+    UTAP::Document& doc = snapshot.get_document();
+    add_all(doc.get_errors(), "error");
+    add_all(doc.get_warnings(), "warning");
+    return diagnostics;
+}
+
+void DiagnosticsModule::update(Server& server, DocumentSnapshot& snapshot)
+{
+    auto diagnostics = collect_diagnostics(snapshot);
+
+    auto lock = std::lock_guard{mutex};
+    auto& previous = sent[snapshot.get_document_id()];
+    auto changed = json::object();
+    for (auto& [xpath, node] : diagnostics) {
+        auto it = previous.find(xpath);
+        if (it == previous.end() || it->second != node)
+            changed[xpath] = node;
+    }
+    for (const auto& [xpath, node] : previous) {
+        if (!diagnostics.contains(xpath))
+            changed[xpath] = json::array();
+    }
+    previous = std::move(diagnostics);
+    if (!changed.empty())
+        server.send_notification("diagnostics", changed);
+}
+
+void DiagnosticsModule::configure(Server& server)
+{
+    repository.add_on_document_update(
+        [this, &server](DocumentSnapshot& snapshot, const DocumentChange&) { update(server, snapshot); });
+}
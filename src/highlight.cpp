@@ -2,18 +2,18 @@
 #include <uls/server.h>
 #include <uls/common_data.h>
 #include <uls/utap_extension.h>
+#include <uls/renaming.h>
 
 #include <nlohmann/json.hpp>
 #include <string>
 #include <iostream>
 #include <string_view>
-
-struct Keyword
-{
-    std::string_view identifier;
-    std::string type;
-    TextRange valid_range;
-};
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <utility>
+#include <limits>
+#include <optional>
 
 template <>
 struct Serializer<Keyword>
@@ -29,12 +29,38 @@ struct Serializer<Keyword>
     }
 };
 
-std::vector<Keyword> keywords_for_path(UTAP::Document& doc, const std::string& xpath)
+/** Keywords added and removed between two notifications */
+struct KeywordChanges
+{
+    std::vector<Keyword> added;
+    std::vector<Keyword> removed;
+};
+
+template <>
+struct Serializer<KeywordChanges>
+{
+    static nlohmann::json serialize(const KeywordChanges& changes)
+    {
+        return {
+            {"added", Serializer<std::vector<Keyword>>::serialize(changes.added)},
+            {"removed", Serializer<std::vector<Keyword>>::serialize(changes.removed)},
+        };
+    }
+};
+
+bool Keyword::operator<(const Keyword& other) const
+{
+    return std::tie(valid_range.begOffset, valid_range.endOffset, identifier, type) <
+           std::tie(other.valid_range.begOffset, other.valid_range.endOffset, other.identifier, other.type);
+}
+
+std::vector<Keyword> keywords_for_path(DocumentSnapshot& snapshot, const std::string& xpath)
 {
-    auto& decls = navigate_xpath(doc, xpath);
+    auto& decls = navigate_xpath(snapshot, xpath);
 
     auto keywords = std::vector<Keyword>{};
-    DeclarationsWalker{doc, true}.visit_symbols(decls, [&](const UTAP::symbol_t& symbol, const TextRange& sym_range) {
+    auto walker = DeclarationsWalker{snapshot.get<PositionTable>(), true};
+    walker.visit_symbols(decls, [&](const UTAP::symbol_t& symbol, const TextRange& sym_range) {
         if (symbol.get_type().is(UTAP::Constants::TYPEDEF)) {
             keywords.push_back({symbol.get_name(), "KEYWORD3", sym_range});
         }
@@ -43,18 +69,178 @@ std::vector<Keyword> keywords_for_path(UTAP::Document& doc, const std::string& x
     return keywords;
 }
 
-void Highlight::configure(Server& server)
+const std::vector<Keyword>& KeywordTable::get(const std::string& xpath)
 {
-    server.add_command<std::string>(
-        "keywords", [this](std::string xpath) { return keywords_for_path(repository.get_document(), xpath); });
+    {
+        auto lock = std::lock_guard{mutex};
+        if (auto it = keywords.find(xpath); it != keywords.end())
+            return it->second;
+    }
+    // Computed without the lock, a concurrent request for the same xpath keeps whichever list is stored first
+    auto computed = keywords_for_path(snapshot, xpath);
+    auto lock = std::lock_guard{mutex};
+    return keywords.try_emplace(xpath, std::move(computed)).first->second;
+}
 
-    repository.add_on_document_update([this, &server](UTAP::Document& doc) {
-        auto keywords = keywords_for_path(doc, repository.get_current_xpath());
-        server.send_notification("keywords", keywords);
-    });
+TokenKind token_kind(const UTAP::type_t& type)
+{
+    if (type.is_array())
+        return token_kind(type.get(0));
+    if (type.is(UTAP::Constants::TYPEDEF))
+        return TokenKind::type;
+    if (type.is_function() || type.is_function_external())
+        return TokenKind::function;
+    if (type.is(UTAP::Constants::INSTANCE))
+        return TokenKind::process;
+    if (type.is_location())
+        return TokenKind::location;
+    if (type.is_channel())
+        return TokenKind::channel;
+    if (type.is_clock())
+        return TokenKind::clock;
+    if (type.is_constant())
+        return TokenKind::constant;
+    return TokenKind::variable;
+}
 
-    repository.add_on_current_node_changed([this, &server](const std::string& xpath) {
-        auto keywords = keywords_for_path(repository.get_document(), xpath);
+std::optional<TokenRange> Deserializer<std::optional<TokenRange>>::deserialize(const nlohmann::json& message)
+{
+    if (!message.is_object())
+        return std::nullopt;
+    auto range = TokenRange{message.at("xpath").get<std::string>()};
+    if (message.contains("start"))
+        range.start = message["start"].get<uint32_t>();
+    if (message.contains("end"))
+        range.end = message["end"].get<uint32_t>();
+    if (range.xpath.ends_with('!'))
+        range.xpath.pop_back();
+    return range;
+}
+
+SemanticTokens::SemanticTokens(DocumentSnapshot& snapshot)
+{
+    auto& positions = snapshot.get<PositionTable>();
+    auto add = [&](const UTAP::position_t& position, const UTAP::symbol_t& symbol) {
+        auto location = TextLocation{positions, position};
+        auto length = location.range.endOffset - location.range.begOffset;
+        nodes[*location.path].push_back({location.range.begOffset, length, token_kind(symbol.get_type())});
+    };
+    auto add_frame = [&](const UTAP::frame_t& frame) {
+        for (const UTAP::symbol_t& symbol : frame)
+            add(symbol.get_position(), symbol);
+    };
+    auto add_functions = [&](auto& self, auto& functions) -> void {
+        for (UTAP::function_t& function : functions) {
+            add_frame(function.body->get_frame());
+            self(self, function.body->functions);
+        }
+    };
+
+    UTAP::Document& doc = snapshot.get_document();
+    add_frame(doc.get_globals().frame);
+    add_functions(add_functions, doc.get_globals().functions);
+    for (UTAP::template_t& templ : doc.get_templates()) {
+        add_frame(templ.parameters);
+        add_frame(templ.frame);
+        add_functions(add_functions, templ.functions);
+    }
+    add_frame(doc.get_system_declarations().frame);
+    add_functions(add_functions, doc.get_system_declarations().functions);
+
+    for (const auto& [symbol, usages] : snapshot.get<UsageIndex>().get_all()) {
+        for (const UTAP::position_t& position : usages)
+            add(position, symbol);
+    }
+
+    // Some identifiers like location names are both declarations and usages
+    auto by_position = [](const SemanticToken& a, const SemanticToken& b) {
+        return a.offset < b.offset || (a.offset == b.offset && a.length < b.length);
+    };
+    auto is_same = [](const SemanticToken& a, const SemanticToken& b) {
+        return a.offset == b.offset && a.length == b.length;
+    };
+    for (auto& [xpath, tokens] : nodes) {
+        std::sort(tokens.begin(), tokens.end(), by_position);
+        tokens.erase(std::unique(tokens.begin(), tokens.end(), is_same), tokens.end());
+    }
+}
+
+nlohmann::json encode_tokens(const std::vector<SemanticToken>& tokens, uint32_t start, uint32_t end)
+{
+    auto first = std::lower_bound(tokens.begin(), tokens.end(), start,
+                                  [](const SemanticToken& token, uint32_t offset) { return token.offset < offset; });
+    nlohmann::json::array_t encoded;
+    uint32_t previous = 0;
+    for (auto it = first; it != tokens.end() && it->offset <= end; ++it) {
+        encoded.push_back(it->offset - std::exchange(previous, it->offset));
+        encoded.push_back(it->length);
+        encoded.push_back(static_cast<uint8_t>(it->kind));
+    }
+    return encoded;
+}
+
+nlohmann::json semantic_tokens(DocumentSnapshot& snapshot, const std::optional<TokenRange>& range)
+{
+    const auto& nodes = snapshot.get<SemanticTokens>().get_nodes();
+    auto encoded = nlohmann::json::object();
+    if (range.has_value()) {
+        if (auto it = nodes.find(range->xpath); it != nodes.end())
+            encoded[range->xpath] = encode_tokens(it->second, range->start, range->end);
+    } else {
+        for (const auto& [xpath, tokens] : nodes)
+            encoded[xpath] = encode_tokens(tokens, 0, std::numeric_limits<uint32_t>::max());
+    }
+    return {{"legend", token_kind_names}, {"nodes", std::move(encoded)}};
+}
+
+void Highlight::notify(Server& server, DocumentSnapshot& snapshot, const std::string& xpath)
+{
+    const std::vector<Keyword>& keywords = snapshot.get<KeywordTable>().get(xpath);
+    auto sorted = keywords;
+    std::sort(sorted.begin(), sorted.end());
+
+    auto lock = std::lock_guard{mutex};
+    if (!send_diffs || !std::exchange(has_sent, true)) {
+        sent = std::move(sorted);
         server.send_notification("keywords", keywords);
+        return;
+    }
+
+    auto changes = KeywordChanges{};
+    std::set_difference(sorted.begin(), sorted.end(), sent.begin(), sent.end(), std::back_inserter(changes.added));
+    std::set_difference(sent.begin(), sent.end(), sorted.begin(), sorted.end(), std::back_inserter(changes.removed));
+    if (changes.added.empty() && changes.removed.empty())
+        return;
+    sent = std::move(sorted);
+    server.send_notification("keywords_diff", changes);
+}
+
+void Highlight::configure(Server& server)
+{
+    server.add_read_only_command<std::string>(
+        "keywords", [this](std::string xpath) { return repository.get_snapshot()->get<KeywordTable>().get(xpath); });
+
+    server.add_simple_command<nlohmann::json>("enable_keyword_diffs", [this] {
+        auto lock = std::lock_guard{mutex};
+        send_diffs = true;
+        return OK_RESPONSE;
     });
-}
\ No newline at end of file
+
+    server.add_read_only_command<std::optional<TokenRange>>(
+        "semantic_tokens", [this](const std::optional<TokenRange>& range) {
+            return semantic_tokens(*repository.get_snapshot(), range);
+        });
+
+    auto on_update = [this, &server](DocumentSnapshot& snapshot, const DocumentChange& change) {
+        if (!change.affects(repository.get_current_xpath()))
+            return;  // The previous notification is still valid
+        notify(server, snapshot, repository.get_current_xpath());
+    };
+    if (notify_when_idle)
+        repository.add_on_document_idle(on_update);
+    else
+        repository.add_on_document_update(on_update);
+
+    repository.add_on_current_node_changed(
+        [this, &server](const std::string& xpath) { notify(server, *repository.get_snapshot(), xpath); });
+}
@@ -1,14 +1,37 @@
 #include <uls/server.h>
 #include <uls/autocomplete.h>
+#include <uls/diagnostics.h>
 #include <iostream>
+#include <chrono>
+#include <cstdlib>
 
 int main()
 {
+    // The server flushes after each batch of messages, stdio syncing and tying cin to cout would flush for every read
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+
     auto system_repo = SystemRepository{};  // Rename this system is technically wrong
+    system_repo.enable_background_parsing(std::chrono::milliseconds{50});
+    system_repo.set_memory_budget(64 * 1024 * 1024);
+    if (const char* cache_directory = std::getenv("ULS_CACHE_DIR"))
+        system_repo.enable_response_cache(cache_directory);
+    if (const char* spill_directory = std::getenv("ULS_SPILL_DIR"))
+        system_repo.enable_compact_storage(spill_directory);
     auto autocomplete_module = AutocompleteModule{system_repo};
+    auto diagnostics_module = DiagnosticsModule{system_repo};
+    auto stats_module = StatsModule{};
 
     auto server = Server({std::cin, std::cout});
-    server.add_close_command("exit").add_module(system_repo).add_module(autocomplete_module).start();
+    server.add_close_command("exit")
+        .add_cancel_command("cancel")
+        .add_batch_command("batch")
+        .add_wire_format_command("wire_format")
+        .add_module(system_repo)
+        .add_module(autocomplete_module)
+        .add_module(diagnostics_module)
+        .add_module(stats_module)
+        .start();
 
     return 0;
 }
\ No newline at end of file
@@ -2,10 +2,13 @@
 #include <uls/server.h>
 #include <uls/declarations.h>
 #include <uls/utap_extension.h>
+#include <uls/worker_pool.h>
 #include <utap/statement.h>
 #include <vector>
 #include <set>
+#include <map>
 #include <iostream>
+#include <algorithm>
 
 using UTAP::Constants::kind_t;
 
@@ -31,51 +34,22 @@ std::set<UTAP::symbol_t> get_symbols(const UTAP::expression_t& expr)
     return symbols;
 }
 
+using UsageMap = std::map<UTAP::symbol_t, std::vector<UTAP::position_t>>;
+
+/** Visits every identifier of a document once and records where each symbol is used */
 class UsageFinder : public UTAP::DocumentVisitor, public UTAP::ExpressionVisitor
 {
-    UTAP::symbol_t target;
-    UTAP::frame_t parent_scope;
-    std::vector<TextLocation> matches;
+    UsageMap& usages;
+    std::vector<UTAP::template_t*>* deferred_templates;
 
-    UTAP::Document* doc;
-
-    virtual void visitDocBefore(UTAP::Document& doc) override
-    {
-        matches.emplace_back(doc, target.get_position());
-        this->doc = &doc;
-        if (is_symbol_visible(doc.get_globals().frame)) {
-            check_declarations(doc.get_globals());
-            for (const UTAP::instance_t& instance : doc.get_instances()) {
-                if (instance.templ->uid == target) {
-                    throw std::logic_error("Cannot rename template names");
-                }
-            }
-            std::cerr << "Query count: " << doc.get_queries().size() << '\n';
-        } else {
-            for (UTAP::function_t& func : doc.get_globals().functions) {
-                if (is_symbol_visible(func.body->get_frame()))
-                    func.body->accept(this);
-            }
-        }
-    }
-
-    virtual bool visitTemplateBefore(UTAP::template_t& templ) override { return is_symbol_visible(templ.frame); }
+    virtual void visitDocBefore(UTAP::Document& doc) override { check_declarations(doc.get_globals()); }
 
     virtual void visitTemplateAfter(UTAP::template_t& templ) override
     {
-        check_declarations(templ);
-        for (UTAP::location_t location : templ.locations) {
-            check_expr(location.cost_rate);
-            check_expr(location.exp_rate);
-            check_expr(location.invariant);
-            check_expr(location.name);
-        }
-        for (UTAP::edge_t edge : templ.edges) {
-            check_expr(edge.assign);
-            check_expr(edge.guard);
-            check_expr(edge.sync);
-            check_expr(edge.prob);
-        }
+        if (deferred_templates != nullptr)
+            deferred_templates->push_back(&templ);
+        else
+            check_template(templ);
     }
 
     virtual void visitExpression(UTAP::expression_t expr) override { check_expr(expr); }
@@ -109,48 +83,91 @@ class UsageFinder : public UTAP::DocumentVisitor, public UTAP::ExpressionVisitor
     void check_expr(UTAP::expression_t expr)
     {
         expr_accept(expr, [this](const UTAP::expression_t& expr) {
-            if (expr.get_symbol() == target) {
-                matches.emplace_back(*doc, expr.get_position());
-            }
+            UTAP::symbol_t symbol = expr.get_symbol();
+            if (symbol != UTAP::symbol_t{})
+                usages[symbol].push_back(expr.get_position());
         });
     }
 
-    bool is_symbol_visible(UTAP::frame_t frame)
+public:
+    /** Templates are independent of each other so they may be checked concurrently by separate finders */
+    void check_template(UTAP::template_t& templ)
     {
-        if (frame == parent_scope)
-            return true;
-
-        while (frame.has_parent()) {
-            frame = frame.get_parent();
-
-            if (frame == parent_scope)
-                return true;
+        check_declarations(templ);
+        for (UTAP::location_t location : templ.locations) {
+            check_expr(location.cost_rate);
+            check_expr(location.exp_rate);
+            check_expr(location.invariant);
+            check_expr(location.name);
+        }
+        for (UTAP::edge_t edge : templ.edges) {
+            check_expr(edge.assign);
+            check_expr(edge.guard);
+            check_expr(edge.sync);
+            check_expr(edge.prob);
         }
-
-        return false;
     }
 
-public:
-    UsageFinder(UTAP::symbol_t target, UTAP::frame_t frame): target{std::move(target)}, parent_scope{std::move(frame)}
+    /** With deferred_templates the templates are collected there instead of being checked */
+    explicit UsageFinder(UsageMap& usages, std::vector<UTAP::template_t*>* deferred_templates = nullptr):
+        usages{usages}, deferred_templates{deferred_templates}
     {}
-    std::vector<TextLocation> get_matches() { return matches; }
 };
 
-std::vector<TextLocation> find_usages(SystemRepository& doc_repo, const Identifier& id)
+UsageIndex::UsageIndex(DocumentSnapshot& snapshot)
 {
-    UTAP::Document& doc = doc_repo.get_document();
-    auto& decls = navigate_xpath(doc, id.xpath, id.offset);
-    UTAP::symbol_t symbol = std::get<UTAP::symbol_t>(find_declaration(doc, decls, id.identifier).value());
+    // Everything but the templates is walked first, then the templates are checked in parallel and merged
+    std::vector<UTAP::template_t*> templates;
+    UsageFinder finder{usages, &templates};
+    snapshot.get_document().accept(finder);
+
+    std::vector<UsageMap> template_usages(templates.size());
+    parallel_for(templates.size(), [&](size_t i) { UsageFinder{template_usages[i]}.check_template(*templates[i]); });
+    for (UsageMap& found : template_usages) {
+        for (auto& [symbol, positions] : found) {
+            std::vector<UTAP::position_t>& merged = usages[symbol];
+            merged.insert(merged.end(), positions.begin(), positions.end());
+        }
+    }
+
+    // Sorted by position such that results do not depend on the order the walk and the merge visit nodes in
+    for (auto& [symbol, positions] : usages)
+        std::ranges::sort(positions, {}, &UTAP::position_t::start);
+}
+
+const std::vector<UTAP::position_t>& UsageIndex::find(const UTAP::symbol_t& symbol) const
+{
+    static const std::vector<UTAP::position_t> no_usages;
+    auto it = usages.find(symbol);
+    return it != usages.end() ? it->second : no_usages;
+}
+
+/** Streams the declaration of the identifier followed by its usages in the order of the usage index */
+void find_usages(SystemRepository& doc_repo, const Identifier& id, ResultSink& sink)
+{
+    auto snapshot = doc_repo.get_snapshot();
+    UTAP::Document& doc = snapshot->get_document();
+    auto& decls = navigate_xpath(*snapshot, id.xpath, id.offset);
+    UTAP::symbol_t symbol = std::get<UTAP::symbol_t>(find_declaration(*snapshot, decls, id.identifier).value());
     if (symbol.get_type().is(UTAP::Constants::INSTANCE))
         throw std::logic_error{"Cannot rename processes"};
+    for (const UTAP::instance_t& instance : doc.get_instances()) {
+        if (instance.templ->uid == symbol)
+            throw std::logic_error("Cannot rename template names");
+    }
 
-    UsageFinder usages{symbol, symbol.get_frame()};
-    doc.accept(usages);
-
-    return usages.get_matches();
+    const std::vector<UTAP::position_t>& usages = snapshot->get<UsageIndex>().find(symbol);
+    auto& positions = snapshot->get<PositionTable>();
+    if (!sink.push(Serializer<TextLocation>::serialize({positions, symbol.get_position()})))
+        return;
+    for (const UTAP::position_t& position : usages) {
+        if (!sink.push(Serializer<TextLocation>::serialize({positions, position})))
+            return;
+    }
 }
 
 void RenamingModule::configure(Server& server)
 {
-    server.add_command<Identifier>("find_usages", [this](const Identifier& id) { return find_usages(doc, id); });
+    server.add_streaming_command<Identifier>(
+        "find_usages", [this](const Identifier& id, ResultSink& sink) { find_usages(doc, id, sink); });
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include <uls/response_cache.h>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+using json = nlohmann::json;
+
+std::filesystem::path response_file(const std::filesystem::path& directory, uint64_t hash)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.cbor", static_cast<unsigned long long>(hash));
+    return directory / name;
+}
+
+uint64_t SavedResponses::hash(std::string_view content)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : content) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string SavedResponses::make_key(std::string_view command, const json& args)
+{
+    std::string key{command};
+    key += '\n';
+    key += args.dump();
+    return key;
+}
+
+void SavedResponses::switch_content(const std::filesystem::path& directory, uint64_t new_hash)
+{
+    if (new_hash == content_hash)
+        return;
+    save(directory);
+    content_hash = new_hash;
+    responses.clear();
+    if (content_hash == 0)
+        return;
+
+    auto file = std::ifstream{response_file(directory, content_hash), std::ios::binary};
+    if (!file)
+        return;
+    auto bytes = std::vector<uint8_t>{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+
+    // A damaged or outdated file is ignored, it is replaced once the responses are saved again
+    json saved = json::from_cbor(bytes, true, false);
+    if (!saved.is_object())
+        return;
+    for (auto& [key, response] : saved.items())
+        responses.emplace(key, std::move(response));
+}
+
+void SavedResponses::save(const std::filesystem::path& directory)
+{
+    if (!is_modified || content_hash == 0)
+        return;
+    is_modified = false;
+
+    auto saved = json::object();
+    for (const auto& [key, response] : responses)
+        saved[key] = response;
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    auto file = std::ofstream{response_file(directory, content_hash), std::ios::binary | std::ios::trunc};
+    std::vector<uint8_t> bytes = json::to_cbor(saved);
+    file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    if (!file)
+        std::cerr << "Could not save responses in " << directory << '\n';
+}
+
+void SavedResponses::add(std::string key, const json& response)
+{
+    if (responses.size() >= max_responses)
+        return;
+    responses.insert_or_assign(std::move(key), response);
+    is_modified = true;
+}
@@ -4,6 +4,10 @@
 #include <thread>
 #include <chrono>
 #include <ranges>
+#include <cctype>
+#include <array>
+#include <utility>
+#include <stdexcept>
 
 namespace views = std::ranges::views;
 using namespace std::chrono_literals;
@@ -12,27 +16,230 @@ using json = nlohmann::json;
 nlohmann::json OK_RESPONSE = {"OK"};
 nlohmann::json FAIL_RESPONSE = {"FAIL"};
 
-std::vector<Command>::const_iterator find_command(const std::vector<Command>& commands, const std::string& name)
+void skip_buffered_whitespace(std::istream& in)
 {
-    auto it = std::find_if(commands.begin(), commands.end(), [&name](const Command& cmd) { return cmd.name == name; });
-    if (it == commands.end())
-        throw std::invalid_argument("Unknown command " + name);
-    return it;
+    std::streambuf* buffer = in.rdbuf();
+    while (buffer->in_avail() > 0 && std::isspace(buffer->sgetc()))
+        buffer->sbumpc();
 }
 
+/** True when the next message is already buffered so reading it will not block */
+bool has_buffered_input(std::istream& in, WireFormat format)
+{
+    if (format == WireFormat::json)
+        skip_buffered_whitespace(in);
+    return in.rdbuf()->in_avail() > 0;
+}
+
+void append_value(std::vector<uint8_t>& out, WireFormat format, const json& value)
+{
+    if (format == WireFormat::cbor)
+        json::to_cbor(value, out);
+    else
+        json::to_msgpack(value, out);
+}
+
+/** Appends a key shorter than 24 characters, the encoding of such keys is the same in CBOR and MessagePack */
+void append_key(std::vector<uint8_t>& out, WireFormat format, std::string_view key)
+{
+    out.push_back((format == WireFormat::cbor ? 0x60 : 0xA0) | static_cast<uint8_t>(key.size()));
+    out.insert(out.end(), key.begin(), key.end());
+}
+
+/** Appends the header of an array with count elements */
+void append_array_header(std::vector<uint8_t>& out, WireFormat format, size_t count)
+{
+    auto append_sized = [&](uint8_t marker, int bytes) {
+        out.push_back(marker);
+        for (int i = bytes - 1; i >= 0; --i)
+            out.push_back(static_cast<uint8_t>(count >> (8 * i)));
+    };
+    if (format == WireFormat::cbor) {
+        if (count < 24)
+            out.push_back(static_cast<uint8_t>(0x80 | count));
+        else if (count <= 0xFF)
+            append_sized(0x98, 1);
+        else if (count <= 0xFFFF)
+            append_sized(0x99, 2);
+        else
+            append_sized(0x9A, 4);
+    } else {
+        if (count < 16)
+            out.push_back(static_cast<uint8_t>(0x90 | count));
+        else if (count <= 0xFFFF)
+            append_sized(0xDC, 2);
+        else
+            append_sized(0xDD, 4);
+    }
+}
+
+/** Skips the elements before the "continuation" of the arguments and stops after their "limit" */
+class PagedSink : public ResultSink
+{
+    size_t skip{0};
+    size_t first{0};
+    std::optional<size_t> limit;
+    bool has_more{false};
+
+protected:
+    size_t count{0};
+
+    virtual void add(const json& element) = 0;
+
+public:
+    explicit PagedSink(const json& args)
+    {
+        if (!args.is_object())
+            return;
+        if (auto it = args.find("continuation"); it != args.end()) {
+            if (!it->is_number_integer() || it->get<int64_t>() < 0)
+                throw std::invalid_argument{"The continuation must be one sent with a previous page"};
+            first = skip = it->get<size_t>();
+        }
+        if (auto it = args.find("limit"); it != args.end()) {
+            // A limit of 0 would answer every page with the same continuation
+            if (!it->is_number_integer() || it->get<int64_t>() <= 0)
+                throw std::invalid_argument{"The limit must be a positive integer"};
+            limit = it->get<size_t>();
+        }
+    }
+
+    bool push(const json& element) override
+    {
+        if (skip > 0) {
+            --skip;
+            return true;
+        }
+        if (limit.has_value() && count == *limit) {
+            has_more = true;
+            return false;
+        }
+        add(element);
+        ++count;
+        return true;
+    }
+
+    bool is_paged() const { return limit.has_value(); }
+    /** Where the next page starts, empty once every element has been sent */
+    std::optional<size_t> continuation() const { return has_more ? std::optional{first + count} : std::nullopt; }
+
+    /** Pages are {"continuation", "items"} objects, responses without a limit are just the items */
+    json wrap(json items) const
+    {
+        if (!is_paged())
+            return items;
+        auto page = json{{"items", std::move(items)}};
+        if (auto next = continuation())
+            page["continuation"] = *next;
+        return page;
+    }
+};
+
+class CollectedSink : public PagedSink
+{
+    json::array_t items;
+
+    void add(const json& element) override { items.push_back(element); }
+
+public:
+    using PagedSink::PagedSink;
+
+    json take() { return wrap(std::move(items)); }
+};
+
+/** Encodes the elements of a streaming command as they arrive, the response is written once the command is done */
+class StreamedResponse : public PagedSink
+{
+    WireFormat format;
+    std::string text;  // Elements separated by commas in the json format
+    std::vector<uint8_t> bytes;  // Encoded elements one after another in the binary formats
+
+    void add(const json& element) override
+    {
+        if (format != WireFormat::json) {
+            append_value(bytes, format, element);
+            return;
+        }
+        if (count > 0)
+            text += ',';
+        text += element.dump();
+    }
+
+public:
+    StreamedResponse(WireFormat format, const json& args): PagedSink{args}, format{format} {}
+
+    WireFormat get_format() const { return format; }
+
+    void write_text(std::ostream& out) const
+    {
+        auto next = continuation();
+        if (is_paged())
+            out << (next.has_value() ? R"({"continuation":)" + std::to_string(*next) + ',' : "{") << R"("items":)";
+        out << '[' << text << ']';
+        if (is_paged())
+            out << '}';
+    }
+
+    void append_encoded(std::vector<uint8_t>& out) const
+    {
+        if (auto next = continuation(); is_paged()) {
+            out.push_back((format == WireFormat::cbor ? 0xA0 : 0x80) | (next.has_value() ? 2 : 1));
+            if (next.has_value()) {
+                append_key(out, format, "continuation");
+                append_value(out, format, *next);
+            }
+            append_key(out, format, "items");
+        }
+        append_array_header(out, format, count);
+        out.insert(out.end(), bytes.begin(), bytes.end());
+    }
+
+    /** Decodes the elements again, needed when the wire format changed while the command ran */
+    json to_json() const
+    {
+        if (format == WireFormat::json)
+            return wrap(json::parse("[" + text + "]"));
+        auto array = std::vector<uint8_t>{};
+        append_array_header(array, format, count);
+        array.insert(array.end(), bytes.begin(), bytes.end());
+        return wrap(format == WireFormat::cbor ? json::from_cbor(array) : json::from_msgpack(array));
+    }
+};
+
 void Server::start()
 {
     is_running = true;
+    loop_thread = std::this_thread::get_id();
     io.out << "json" << std::endl;
 
     json message;
 
     while (is_running) {
         try {
-            io.in >> message;
-            auto cmd = find_command(commands, message["cmd"].get<std::string>());
-            auto response = cmd->callback(message["args"]);
-            send("response/" + cmd->name, response);
+            // Responses are flushed once all buffered messages are handled, the client may be waiting for them
+            if (!has_buffered_input(io.in, wire_format))
+                flush();
+            if (!read_message(message)) {
+                send_error("Input ended in the middle of a message");
+                stop();
+                continue;
+            }
+            const json* id = message.contains("id") ? &message["id"] : nullptr;
+            const auto& name = message["cmd"].get_ref<const std::string&>();
+            auto it = commands.find(name);
+            if (it == commands.end()) {
+                send_error("Unknown command " + name, id);
+                continue;
+            }
+
+            Command& cmd = it->second;
+            if (cmd.is_read_only && id != nullptr)
+                handle_concurrently(cmd, *id, std::move(message["args"]));
+            else
+                handle(cmd, message["args"], id);
+
+            if (requested_format.has_value())
+                switch_wire_format(*std::exchange(requested_format, std::nullopt));
         } catch (nlohmann::json::parse_error& e) {
             send_error(e.what());
             stop();
@@ -40,6 +247,132 @@ void Server::start()
             send_error(e.what());
         }
     }
+
+    workers.reset();  // Finish the queued requests
+    flush();
+    for (ServerModule* server_module : modules)
+        server_module->shutdown();
+}
+
+bool Server::read_message(json& message)
+{
+    if (wire_format == WireFormat::json) {
+        io.in >> message;
+        return true;
+    }
+
+    std::array<uint8_t, 4> header;
+    if (!io.in.read(reinterpret_cast<char*>(header.data()), header.size()))
+        return false;
+    uint32_t size = uint32_t{header[0]} << 24 | uint32_t{header[1]} << 16 | uint32_t{header[2]} << 8 | header[3];
+
+    std::vector<uint8_t> payload(size);
+    if (!io.in.read(reinterpret_cast<char*>(payload.data()), size))
+        return false;
+    message = wire_format == WireFormat::cbor ? json::from_cbor(payload) : json::from_msgpack(payload);
+    return true;
+}
+
+void Server::switch_wire_format(WireFormat format)
+{
+    // The client ends the switching message with a newline or similar before sending its first frame
+    if (wire_format == WireFormat::json)
+        skip_buffered_whitespace(io.in);
+
+    auto lock = std::lock_guard{output_mutex};
+    wire_format = format;
+}
+
+void Server::handle(Command& cmd, json& args, const json* id)
+{
+    if (cmd.stream) {
+        handle_streamed(cmd, args, id);
+        return;
+    }
+
+    try {
+        auto timing = RequestTiming{};
+        auto stopwatch = Stopwatch{};
+        std::optional<ResponseCache::Lookup> lookup;
+        if (cmd.is_read_only && response_cache != nullptr)
+            lookup = response_cache->lookup(cmd.name, args);
+
+        json response;
+        if (lookup.has_value() && lookup->response.has_value()) {
+            response = std::move(*lookup->response);
+            timing.handler = stopwatch.lap();
+        } else {
+            response = cmd.callback(args, timing);
+            stopwatch.lap();
+        }
+        send("response/" + cmd.name, response, id);
+        timing.serialize += stopwatch.lap();
+        statistics.record(cmd.name, timing);
+
+        if (lookup.has_value() && !lookup->response.has_value())
+            response_cache->store(*lookup, response);
+    } catch (std::exception& e) {
+        send_error(e.what(), id);
+    }
+}
+
+void Server::handle_streamed(Command& cmd, json& args, const json* id)
+{
+    try {
+        auto timing = RequestTiming{};
+        WireFormat format;
+        {
+            auto lock = std::lock_guard{output_mutex};
+            format = wire_format;
+        }
+        // Elements are encoded as they are pushed, which counts towards the handler time
+        auto response = StreamedResponse{format, args};
+        cmd.stream(args, timing, response);
+        auto stopwatch = Stopwatch{};
+        send_streamed("response/" + cmd.name, response, id);
+        timing.serialize = stopwatch.lap();
+        statistics.record(cmd.name, timing);
+    } catch (std::exception& e) {
+        send_error(e.what(), id);
+    }
+}
+
+json Server::collect_stream(const Command::StreamCallback& stream, json& args, RequestTiming& timing)
+{
+    auto sink = CollectedSink{args};
+    stream(args, timing, sink);
+    return sink.take();
+}
+
+void Server::handle_concurrently(Command& cmd, json id, json args)
+{
+    if (workers == nullptr)
+        workers = std::make_unique<WorkerPool>(worker_count);
+
+    // A worker may pick the request up after later commands changed the document, so the contexts are captured now
+    auto run = [this, &cmd, id, args = std::move(args), contexts = capture_contexts()]() mutable {
+        std::vector<std::shared_ptr<void>> entered;
+        for (auto& enter : contexts)
+            entered.push_back(enter());
+        handle(cmd, args, &id);
+    };
+    auto on_cancel = [this, id] { send_error("Request cancelled", &id); };
+    workers->submit(std::move(id), std::move(run), std::move(on_cancel));
+}
+
+std::vector<std::function<std::shared_ptr<void>()>> Server::capture_contexts() const
+{
+    std::vector<std::function<std::shared_ptr<void>()>> contexts;
+    for (auto& capture : batch_contexts)
+        contexts.push_back(capture());
+    return contexts;
+}
+
+Server& Server::register_command(Command command)
+{
+    std::string name = command.name;
+    commands.try_emplace(std::move(name), std::move(command));
+    return *this;
 }
 
 Server& Server::add_close_command(std::string name)
@@ -51,14 +384,156 @@ Server& Server::add_close_command(std::string name)
     return *this;
 }
 
-void Server::send(const std::string& message_type, const nlohmann::json& message)
+Server& Server::add_batch_command(std::string name)
+{
+    return add_read_only_command<json&>(std::move(name), [this](json& requests) {
+        if (!requests.is_array())
+            throw std::invalid_argument{"Batch arguments must be an array of commands"};
+
+        // Off the command loop the batch already runs inside the contexts captured when it was received
+        std::vector<std::shared_ptr<void>> contexts;
+        if (std::this_thread::get_id() == loop_thread) {
+            for (auto& enter : capture_contexts())
+                contexts.push_back(enter());
+        }
+
+        json::array_t responses;
+        responses.reserve(requests.size());
+        for (json& request : requests) {
+            try {
+                auto it = commands.find(request.at("cmd").get_ref<const std::string&>());
+                if (it == commands.end() || !it->second.is_read_only)
+                    throw std::invalid_argument{"Only read-only commands can be batched"};
+                auto timing = RequestTiming{};
+                responses.push_back(it->second.callback(request["args"], timing));
+            } catch (std::exception& e) {
+                responses.push_back({{"error", e.what()}});
+            }
+        }
+        return json(std::move(responses));
+    });
+}
+
+Server& Server::add_batch_context(std::function<std::function<std::shared_ptr<void>()>()> capture)
+{
+    batch_contexts.push_back(std::move(capture));
+    return *this;
+}
+
+Server& Server::add_cancel_command(std::string name)
 {
-    io.out << json{{"res", message_type}, {"info", message}} << std::endl;
+    return add_command<const json&>(std::move(name), [this](const json& id) {
+        return workers != nullptr && workers->cancel(id) ? OK_RESPONSE : FAIL_RESPONSE;
+    });
 }
 
-void Server::send_error(const nlohmann::json& message)
+Server& Server::add_wire_format_command(std::string name)
 {
-    send("err", message);
+    return add_command<std::string>(std::move(name), [this](const std::string& format) {
+        if (format == "json")
+            requested_format = WireFormat::json;
+        else if (format == "cbor")
+            requested_format = WireFormat::cbor;
+        else if (format == "msgpack")
+            requested_format = WireFormat::msgpack;
+        else
+            throw std::invalid_argument{"Unknown wire format " + format};
+        return OK_RESPONSE;
+    });
+}
+
+Server& Server::set_response_cache(ResponseCache& cache)
+{
+    response_cache = &cache;
+    return *this;
+}
+
+Server& Server::set_worker_count(size_t count)
+{
+    worker_count = std::max<size_t>(count, 1);
+    return *this;
+}
+
+void Server::send(const std::string& message_type, const nlohmann::json& message, const nlohmann::json* id)
+{
+    auto lock = std::lock_guard{output_mutex};
+    write_message(message_type, message, id);
+}
+
+void Server::write_message(const std::string& message_type, const nlohmann::json& message, const nlohmann::json* id)
+{
+    if (wire_format != WireFormat::json) {
+        write_frame(message_type, [&](std::vector<uint8_t>& out) { append_value(out, wire_format, message); }, id);
+        return;
+    }
+
+    // Written field by field instead of through a wrapper object, keys keep the sorted order of nlohmann::json
+    io.out << '{';
+    if (id != nullptr)
+        io.out << R"("id":)" << *id << ',';
+    io.out << R"("info":)" << message << R"(,"res":")" << message_type << "\"}\n";
+
+    // Nothing flushes for other threads so their notifications are written immediately
+    if (std::this_thread::get_id() != loop_thread)
+        io.out.flush();
+}
+
+void Server::send_streamed(const std::string& message_type, const StreamedResponse& response, const json* id)
+{
+    auto lock = std::lock_guard{output_mutex};
+    if (response.get_format() != wire_format) {
+        write_message(message_type, response.to_json(), id);
+        return;
+    }
+    if (wire_format != WireFormat::json) {
+        write_frame(message_type, [&](std::vector<uint8_t>& out) { response.append_encoded(out); }, id);
+        return;
+    }
+
+    io.out << '{';
+    if (id != nullptr)
+        io.out << R"("id":)" << *id << ',';
+    io.out << R"("info":)";
+    response.write_text(io.out);
+    io.out << R"(,"res":")" << message_type << "\"}\n";
+
+    if (std::this_thread::get_id() != loop_thread)
+        io.out.flush();
+}
+
+void Server::write_frame(const std::string& message_type,
+                         const std::function<void(std::vector<uint8_t>&)>& append_info, const json* id)
+{
+    frame.assign(4, 0);  // Size is filled in once the message is encoded
+    uint8_t entries = id != nullptr ? 3 : 2;
+    frame.push_back((wire_format == WireFormat::cbor ? 0xA0 : 0x80) | entries);
+    if (id != nullptr) {
+        append_key(frame, wire_format, "id");
+        append_value(frame, wire_format, *id);
+    }
+    append_key(frame, wire_format, "info");
+    append_info(frame);
+    append_key(frame, wire_format, "res");
+    append_value(frame, wire_format, message_type);
+
+    auto size = static_cast<uint32_t>(frame.size() - 4);
+    for (int i = 0; i < 4; ++i)
+        frame[i] = static_cast<uint8_t>(size >> (24 - 8 * i));
+    io.out.write(reinterpret_cast<const char*>(frame.data()), static_cast<std::streamsize>(frame.size()));
+
+    if (std::this_thread::get_id() != loop_thread)
+        io.out.flush();
+}
+
+void Server::flush()
+{
+    auto lock = std::lock_guard{output_mutex};
+    io.out.flush();
+}
+
+void Server::send_error(const nlohmann::json& message, const nlohmann::json* id)
+{
+    send("err", message, id);
 }
 
 void Server::stop() { is_running = false; }
@@ -66,9 +541,38 @@ void Server::stop() { is_running = false; }
 Server& Server::add_module(ServerModule& server_module)
 {
     server_module.configure(*this);
+    modules.push_back(&server_module);
     return *this;
 }
 
-std::string Deserializer<std::string>::deserialize(const json& message) { return message.get<std::string>(); }
+std::string Deserializer<std::string>::deserialize(const json& message)
+{
+    if (message.is_binary())
+        return {message.get_binary().begin(), message.get_binary().end()};
+    return message.get<std::string>();
+}
+
+std::string Deserializer<std::string>::deserialize(json& message)
+{
+    if (message.is_binary())
+        return {message.get_binary().begin(), message.get_binary().end()};
+    return std::move(message.get_ref<std::string&>());
+}
 
-json Serializer<std::string>::serialize(const std::string& str) { return {str}; }
\ No newline at end of file
+std::string_view Deserializer<std::string_view>::deserialize(const json& message)
+{
+    if (message.is_binary()) {
+        const auto& bytes = message.get_binary();
+        return {reinterpret_cast<const char*>(bytes.data()), bytes.size()};
+    }
+    return message.get_ref<const std::string&>();
+}
+
+json Serializer<std::string>::serialize(const std::string& str) { return {str}; }
+
+json Serializer<std::string>::serialize(std::string&& str)
+{
+    json::array_t array;
+    array.emplace_back(std::move(str));
+    return array;
+}
\ No newline at end of file
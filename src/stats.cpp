@@ -0,0 +1,104 @@
+#include <uls/stats.h>
+#include <uls/server.h>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+
+using json = nlohmann::json;
+
+void Statistics::record(const std::string& name, const RequestTiming& timing)
+{
+    auto lock = std::lock_guard{mutex};
+    Entry& entry = entries[name];
+    entry.count++;
+    entry.totals.deserialize += timing.deserialize;
+    entry.totals.handler += timing.handler;
+    entry.totals.serialize += timing.serialize;
+
+    if (entry.latencies.size() < max_samples)
+        entry.latencies.push_back(timing.total());
+    else
+        entry.latencies[entry.next_sample] = timing.total();
+    entry.next_sample = (entry.next_sample + 1) % max_samples;
+}
+
+double to_microseconds(std::chrono::nanoseconds time)
+{
+    return std::chrono::duration<double, std::micro>{time}.count();
+}
+
+double percentile(std::vector<std::chrono::nanoseconds>& samples, double fraction)
+{
+    auto nth = samples.begin() + static_cast<ptrdiff_t>(fraction * static_cast<double>(samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return to_microseconds(*nth);
+}
+
+json Statistics::summary() const
+{
+    auto lock = std::lock_guard{mutex};
+    json result = json::object();
+    for (const auto& [name, entry] : entries) {
+        auto samples = entry.latencies;
+        auto count = static_cast<double>(entry.count);
+        result[name] = {
+            {"count", entry.count},
+            {"p50_us", percentile(samples, 0.50)},
+            {"p95_us", percentile(samples, 0.95)},
+            {"p99_us", percentile(samples, 0.99)},
+            {"mean_deserialize_us", to_microseconds(entry.totals.deserialize) / count},
+            {"mean_handler_us", to_microseconds(entry.totals.handler) / count},
+            {"mean_serialize_us", to_microseconds(entry.totals.serialize) / count},
+        };
+    }
+    return result;
+}
+
+void StatsModule::configure(Server& server)
+{
+    this->server = &server;
+    server.add_simple_command<json>("stats", [&server]() { return server.get_statistics().summary(); });
+    server.add_command<const json&>("stats_interval", [this](const json& milliseconds) {
+        set_interval(std::chrono::milliseconds{milliseconds.get<int64_t>()});
+        return OK_RESPONSE;
+    });
+    set_interval(interval);
+}
+
+void StatsModule::set_interval(std::chrono::milliseconds new_interval)
+{
+    auto lock = std::lock_guard{mutex};
+    interval = new_interval;
+    if (interval.count() > 0 && !notifier.joinable() && !is_stopping)
+        notifier = std::thread{[this] { run_notifier(); }};
+    interval_changed.notify_all();
+}
+
+void StatsModule::run_notifier()
+{
+    auto lock = std::unique_lock{mutex};
+    while (!is_stopping) {
+        auto current = interval;
+        auto is_changed = [&] { return is_stopping || interval != current; };
+        if (current.count() <= 0) {
+            interval_changed.wait(lock, is_changed);
+            continue;
+        }
+        if (interval_changed.wait_for(lock, current, is_changed))
+            continue;
+
+        lock.unlock();
+        server->send_notification("stats", server->get_statistics().summary());
+        lock.lock();
+    }
+}
+
+void StatsModule::shutdown()
+{
+    {
+        auto lock = std::lock_guard{mutex};
+        is_stopping = true;
+    }
+    interval_changed.notify_all();
+    if (notifier.joinable())
+        notifier.join();
+}
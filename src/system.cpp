@@ -1,34 +1,473 @@
 #include <uls/system.h>
 #include <uls/server.h>
 #include <utap/utap.h>
+#include <nlohmann/json.hpp>
+#include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <tuple>
+#include <charconv>
+#include <optional>
+#include <utility>
 
-void SystemRepository::upload(std::string document)
+void SystemRepository::upload(std::string_view document)
 {
-    working_doc.set_document(std::move(document));
-    doc = working_doc.parse();
+    auto lock = std::unique_lock{mutex};
+    active->working_doc.set_document(document);
+    // Hashes the xml that is parsed and published, which escapes differently than the upload e.g. "&quot;"
+    if (!cache_directory.empty())
+        switch_responses(*active, active->working_doc.to_xml());
+    evict_documents();
+    update_document(lock);
+}
+
+void SystemRepository::edit(const std::vector<TextEdit>& edits)
+{
+    auto lock = std::unique_lock{mutex};
+    if (active->working_doc.empty())
+        throw std::logic_error{"Cannot edit before a document is uploaded"};
+
+    for (const TextEdit& text_edit : edits)
+        active->working_doc.apply_edit(text_edit);
+    switch_responses(*active, {});  // The new content is hashed once it is parsed
+    update_document(lock);
+}
+
+void SystemRepository::update_document(std::unique_lock<std::mutex>& lock)
+{
+    uint64_t version = ++active->requested_version;
+    if (parse_worker.joinable()) {
+        document_changed.notify_all();
+        return;
+    }
 
-    // Fire on document update event
+    // Reuse the previous document when the upload did not change anything, e.g. the client resending on save
+    if (active->doc != nullptr && active->working_doc.get_changes().empty()) {
+        active->parsed_version = version;
+        return;
+    }
+
+    // Commands on other documents or threads may run while the copy is parsed
+    std::shared_ptr<OpenDocument> target = active;
+    auto revision = target->working_doc.get_revision();
+    lock.unlock();
+    auto stopwatch = Stopwatch{};
+    std::unique_ptr<UTAP::Document> parsed;
+    try {
+        parsed = revision.parse();
+    } catch (...) {
+        // The version is settled even though it failed, commands waiting for a first parse get an error
+        lock.lock();
+        target->parsed_version = std::max(target->parsed_version, version);
+        document_changed.notify_all();
+        throw;
+    }
+    auto parse_time = stopwatch.lap();
+    lock.lock();
+    record_parse(parse_time);
+
+    // A concurrent upload of the same document may already have published a newer version
+    if (target->parsed_version > version)
+        return;
+    publish(lock, target, revision, version, std::move(parsed));
+}
+
+void SystemRepository::publish(std::unique_lock<std::mutex>& lock, std::shared_ptr<OpenDocument> target,
+                               const WorkingDocument::Revision& revision, uint64_t version,
+                               std::unique_ptr<UTAP::Document> parsed)
+{
+    auto snapshot = std::make_shared<DocumentSnapshot>(std::move(parsed), version, target->id);
+    target->doc = snapshot;
+    target->parsed_version = version;
+    target->working_doc.set_parsed(revision);
+    target->publish_number = ++publish_count;
+    switch_responses(*target, revision.xml);
+    bool is_active = target == active;
+    lock.unlock();
+    document_changed.notify_all();
+
+    // Fire on document update event, a document parsed after switching away is reported when it is selected again
+    if (is_active)
+        fire_update(snapshot, revision.change);
+}
+
+void SystemRepository::fire_update(const std::shared_ptr<DocumentSnapshot>& snapshot, const DocumentChange& change)
+{
     for (auto& handler : on_document_update)
-        handler(*doc);
+        handler(*snapshot, change);
+
+    if (on_document_idle.empty())
+        return;
+    {
+        auto lock = std::lock_guard{mutex};
+        idle_snapshot = snapshot;
+        idle_change.merge(change);
+        ++update_count;
+    }
+    document_changed.notify_all();
 }
 
-void SystemRepository::change_node(std::string xpath)
+void SystemRepository::run_idle_worker()
+{
+    auto lock = std::unique_lock{mutex};
+    while (true) {
+        document_changed.wait(lock, [this] { return is_stopping || idle_snapshot != nullptr; });
+        for (uint64_t seen = 0; !is_stopping && !skip_idle_period && seen != update_count;) {
+            seen = update_count;
+            document_changed.wait_for(lock, idle_period,
+                                      [&] { return is_stopping || skip_idle_period || seen != update_count; });
+        }
+        skip_idle_period = false;
+        if (is_stopping)
+            return;
+
+        auto snapshot = std::exchange(idle_snapshot, nullptr);
+        auto change = std::exchange(idle_change, DocumentChange{});
+        lock.unlock();
+        for (auto& handler : on_document_idle)
+            handler(*snapshot, change);
+        lock.lock();
+    }
+}
+
+void SystemRepository::run_parse_worker()
+{
+    auto lock = std::unique_lock{mutex};
+    while (true) {
+        document_changed.wait(lock, [this] {
+            return is_stopping || active->requested_version != active->parsed_version;
+        });
+        std::shared_ptr<OpenDocument> target = active;
+
+        // Wait for a period without changes, versions arriving meanwhile supersede the one we were about to parse
+        auto is_interrupted = [&] { return is_stopping || target != active; };
+        for (uint64_t seen = target->parsed_version;
+             !is_interrupted() && !skip_debounce && seen != target->requested_version;) {
+            seen = target->requested_version;
+            document_changed.wait_for(lock, debounce, [&] {
+                return is_interrupted() || skip_debounce || seen != target->requested_version;
+            });
+        }
+        skip_debounce = false;
+        if (is_stopping)
+            return;
+        if (target != active)
+            continue;  // The client switched document before the changes settled
+
+        uint64_t version = target->requested_version;
+        if (target->doc != nullptr && target->working_doc.get_changes().empty()) {
+            target->parsed_version = version;
+            continue;
+        }
+        auto revision = target->working_doc.get_revision();
+
+        // UTAP cannot abort a parse, newer versions are picked up once this one is published
+        lock.unlock();
+        std::unique_ptr<UTAP::Document> parsed;
+        auto stopwatch = Stopwatch{};
+        try {
+            parsed = revision.parse();
+        } catch (std::exception& e) {
+            std::cerr << "Background parse failed: " << e.what() << '\n';
+        }
+        auto parse_time = stopwatch.lap();
+        lock.lock();
+        record_parse(parse_time);
+
+        if (is_stopping)
+            return;
+        if (parsed == nullptr) {
+            target->parsed_version = version;
+            document_changed.notify_all();
+            continue;
+        }
+        publish(lock, target, revision, version, std::move(parsed));
+        lock.lock();
+    }
+}
+
+void SystemRepository::record_parse(std::chrono::nanoseconds parse_time)
 {
-    current_node = std::move(xpath);
+    if (statistics != nullptr)
+        statistics->record("parse", {.handler = parse_time});
+}
+
+void SystemRepository::evict_documents()
+{
+    size_t usage = 0;
+    for (const auto& [id, document] : documents)
+        usage += document->working_doc.memory_usage();
 
-    if (doc == nullptr)
+    while (usage > memory_budget && documents.size() > 1) {
+        auto lru = documents.end();
+        for (auto it = documents.begin(); it != documents.end(); ++it) {
+            if (it->second != active && (lru == documents.end() || it->second->last_used < lru->second->last_used))
+                lru = it;
+        }
+        usage -= lru->second->working_doc.memory_usage();
+        switch_responses(*lru->second, {});
+        documents.erase(lru);
+    }
+}
+
+bool SystemRepository::select_document(const std::string& id)
+{
+    std::shared_ptr<DocumentSnapshot> snapshot;
+    bool is_open;
+    {
+        auto lock = std::lock_guard{mutex};
+        auto [it, is_new] = documents.try_emplace(id);
+        if (is_new) {
+            it->second = std::make_shared<OpenDocument>();
+            it->second->id = id;
+        }
+        is_open = !is_new;
+        if (it->second == active)
+            return is_open;
+
+        if (!spill_directory.empty() && !active->working_doc.empty()) {
+            auto file = spill_directory / ("document-" + std::to_string(++spill_count) + ".xml");
+            if (!active->working_doc.spill_markup(file))
+                std::cerr << "Could not spill the document markup to " << file << '\n';
+        }
+        it->second->working_doc.restore_markup();
+        active = it->second;
+        active->last_used = ++use_count;
+        snapshot = active->doc;
+    }
+    document_changed.notify_all();  // The selected document may have changes waiting to be parsed
+
+    if (snapshot != nullptr)
+        fire_update(snapshot, DocumentChange::everything());
+    return is_open;
+}
+
+void SystemRepository::close_document(const std::string& id)
+{
+    auto lock = std::lock_guard{mutex};
+    auto it = documents.find(id);
+    if (it == documents.end())
         return;
+    if (it->second == active)
+        throw std::logic_error{"Cannot close the selected document"};
+    switch_responses(*it->second, {});
+    documents.erase(it);
+}
+
+void SystemRepository::switch_responses(OpenDocument& document, std::string_view content)
+{
+    if (!cache_directory.empty())
+        document.saved_responses.switch_content(cache_directory, content.empty() ? 0 : SavedResponses::hash(content));
+}
+
+void SystemRepository::enable_response_cache(std::filesystem::path directory)
+{
+    auto lock = std::lock_guard{mutex};
+    cache_directory = std::move(directory);
+}
+
+void SystemRepository::enable_compact_storage(std::filesystem::path directory)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    auto lock = std::lock_guard{mutex};
+    spill_directory = std::move(directory);
+}
+
+nlohmann::json SystemRepository::memory_stats() const
+{
+    auto lock = std::lock_guard{mutex};
+    auto result = nlohmann::json::object();
+    size_t total = 0;
+    for (const auto& [id, document] : documents) {
+        auto stats = document->working_doc.get_memory_stats();
+        total += document->working_doc.memory_usage();
+        result["documents"][id] = {
+            {"markup", stats.markup},
+            {"spilled_markup", stats.spilled_markup},
+            {"text", stats.text},
+            {"xpaths", stats.xpaths},
+            {"pieces", stats.pieces},
+            {"saved_responses", document->saved_responses.responses.size()},
+            {"saved_response_hits", document->saved_responses.hits},
+            {"saved_response_misses", document->saved_responses.misses},
+            {"is_parsed", document->doc != nullptr},
+        };
+    }
+    result["total"] = total;
+    result["budget"] = memory_budget;
+    return result;
+}
+
+// Snapshot pinned for the batch or concurrent request running on this thread
+thread_local const SystemRepository* pinning_repository = nullptr;
+thread_local std::shared_ptr<DocumentSnapshot> pinned_snapshot;
+
+ResponseCache::Lookup SystemRepository::lookup(const std::string& command, const nlohmann::json& args)
+{
+    auto lookup = Lookup{{}, SavedResponses::make_key(command, args)};
+    auto lock = std::lock_guard{mutex};
+    SavedResponses& saved = active->saved_responses;
+    if (pinning_repository == this && pinned_snapshot != nullptr && pinned_snapshot != active->doc)
+        return lookup;  // Answered from a snapshot older than the current model, it is neither looked up nor saved
+
+    bool is_parsed = active->doc != nullptr && active->parsed_version == active->requested_version;
+    if (is_parsed) {
+        lookup.state = active->publish_number;
+    } else if (auto it = saved.responses.find(lookup.key); it != saved.responses.end()) {
+        lookup.response = it->second;
+        ++saved.hits;
+    } else if (saved.content_hash != 0) {
+        ++saved.misses;
+    }
+    return lookup;
+}
+
+void SystemRepository::store(const Lookup& lookup, const nlohmann::json& response)
+{
+    auto lock = std::lock_guard{mutex};
+    // A response computed from an older snapshot than the one the saved responses belong to is dropped
+    bool is_parsed = active->parsed_version == active->requested_version;
+    if (lookup.state != 0 && lookup.state == active->publish_number && is_parsed)
+        active->saved_responses.add(lookup.key, response);
+}
+
+void SystemRepository::set_memory_budget(size_t budget)
+{
+    auto lock = std::lock_guard{mutex};
+    memory_budget = budget;
+    evict_documents();
+}
+
+void SystemRepository::enable_background_parsing(std::chrono::milliseconds debounce_period)
+{
+    auto lock = std::lock_guard{mutex};
+    debounce = debounce_period;
+    if (!parse_worker.joinable())
+        parse_worker = std::thread{[this] { run_parse_worker(); }};
+}
+
+void SystemRepository::parse_pending()
+{
+    {
+        auto lock = std::lock_guard{mutex};
+        if (active->requested_version == active->parsed_version)
+            return;
+        skip_debounce = true;
+    }
+    document_changed.notify_all();
+}
+
+void SystemRepository::shutdown()
+{
+    {
+        auto lock = std::lock_guard{mutex};
+        is_stopping = true;
+    }
+    document_changed.notify_all();
+    if (parse_worker.joinable())
+        parse_worker.join();
+    if (idle_worker.joinable())
+        idle_worker.join();
+
+    auto lock = std::lock_guard{mutex};
+    for (auto& [id, document] : documents)
+        switch_responses(*document, {});
+}
+
+std::function<std::shared_ptr<void>()> SystemRepository::pin_snapshot()
+{
+    std::shared_ptr<DocumentSnapshot> snapshot;
+    if (pinning_repository == this && pinned_snapshot != nullptr) {
+        snapshot = pinned_snapshot;
+    } else {
+        auto lock = std::lock_guard{mutex};
+        snapshot = active->doc;
+    }
+    if (snapshot == nullptr)
+        return [] { return std::shared_ptr<void>{}; };  // Commands needing a document wait or fail on their own
+
+    return [this, snapshot = std::move(snapshot)]() -> std::shared_ptr<void> {
+        auto restore = [previous = std::pair{pinning_repository, pinned_snapshot}](void*) {
+            std::tie(pinning_repository, pinned_snapshot) = previous;
+        };
+        pinning_repository = this;
+        pinned_snapshot = snapshot;
+        return {nullptr, restore};
+    };
+}
+
+std::shared_ptr<DocumentSnapshot> SystemRepository::get_snapshot() const
+{
+    if (pinning_repository == this && pinned_snapshot != nullptr)
+        return pinned_snapshot;
+
+    auto lock = std::unique_lock{mutex};
+    if (active->requested_version == 0)
+        throw std::logic_error{"No document uploaded"};
+
+    document_changed.wait(lock, [this] {
+        return active->doc != nullptr || active->parsed_version == active->requested_version || is_stopping;
+    });
+    if (active->doc == nullptr && is_stopping)
+        throw std::logic_error{"Server stopped before the document was parsed"};
+    if (active->doc == nullptr)
+        throw std::logic_error{"The document could not be parsed"};
+    return active->doc;
+}
+
+std::shared_ptr<UTAP::Document> SystemRepository::get_document() const
+{
+    auto snapshot = get_snapshot();
+    return {snapshot, &snapshot->get_document()};
+}
+
+bool SystemRepository::has_document() const
+{
+    auto lock = std::lock_guard{mutex};
+    return active->doc != nullptr;
+}
+
+std::string SystemRepository::get_current_xpath() const
+{
+    auto lock = std::lock_guard{mutex};
+    return active->current_node;
+}
+
+void SystemRepository::change_node(std::string xpath)
+{
+    {
+        auto lock = std::lock_guard{mutex};
+        active->current_node = xpath;
+
+        if (active->doc == nullptr)
+            return;
+    }
 
     // Fire on current document changed event
     for (auto& handler : on_current_node_changed)
-        handler(current_node);
+        handler(xpath);
 }
 
 void SystemRepository::configure(Server& server)
 {
-    server.add_command<std::string>("upload", [this](std::string doc_str) {
-        upload(std::move(doc_str));
+    {
+        auto lock = std::lock_guard{mutex};
+        statistics = &server.get_statistics();
+        if (!cache_directory.empty())
+            server.set_response_cache(*this);
+    }
+    server.add_batch_context([this] { return pin_snapshot(); });
+    // The document is only copied once, when it is split into the pieces of the working document
+    server.add_command<std::string_view>("upload", [this](std::string_view doc_str) {
+        upload(doc_str);
+        return OK_RESPONSE;
+    });
+
+    server.add_command<std::vector<TextEdit>>("edit", [this](const std::vector<TextEdit>& edits) {
+        edit(edits);
         return OK_RESPONSE;
     });
 
@@ -36,36 +475,526 @@ void SystemRepository::configure(Server& server)
         change_node(std::move(xpath));
         return OK_RESPONSE;
     });
+
+    server.add_command<std::string>("select_document", [this](const std::string& id) {
+        return select_document(id) ? OK_RESPONSE : FAIL_RESPONSE;
+    });
+
+    server.add_command<std::string>("close_document", [this](const std::string& id) {
+        close_document(id);
+        return OK_RESPONSE;
+    });
+
+    server.add_simple_command<nlohmann::json>("memory_stats", [this] { return memory_stats(); });
 }
 
-void SystemRepository::add_on_document_update(std::function<void(UTAP::Document&)> handler)
+void SystemRepository::add_on_document_update(std::function<void(DocumentSnapshot&, const DocumentChange&)> handler)
 {
     on_document_update.push_back(std::move(handler));
 }
 
+void SystemRepository::add_on_document_idle(std::function<void(DocumentSnapshot&, const DocumentChange&)> handler)
+{
+    auto lock = std::lock_guard{mutex};
+    on_document_idle.push_back(std::move(handler));
+    if (!idle_worker.joinable() && !is_stopping)
+        idle_worker = std::thread{[this] { run_idle_worker(); }};
+}
+
+void SystemRepository::set_idle_period(std::chrono::milliseconds period)
+{
+    auto lock = std::lock_guard{mutex};
+    idle_period = period;
+}
+
+void SystemRepository::flush_idle()
+{
+    {
+        auto lock = std::lock_guard{mutex};
+        if (idle_snapshot == nullptr)
+            return;
+        skip_idle_period = true;
+    }
+    document_changed.notify_all();
+}
+
 void SystemRepository::add_on_current_node_changed(std::function<void(const std::string&)> handler)
 {
     on_current_node_changed.push_back(std::move(handler));
 }
 
-void WorkingDocument::set_document(std::string document) { this->document = std::move(document); }
+bool is_in_section(std::string_view xpath, std::string_view section)
+{
+    return xpath.starts_with(section) &&
+           (xpath.size() == section.size() || xpath[section.size()] == '/' || xpath[section.size()] == '!');
+}
 
-std::unique_ptr<UTAP::Document> WorkingDocument::parse() const
+void DocumentChange::merge(const DocumentChange& other)
 {
-    auto doc = std::make_unique<UTAP::Document>();
-    parse_XML_buffer(document.c_str(), doc.get(), true, {});
-    return doc;
+    sections.insert(sections.end(), other.sections.begin(), other.sections.end());
+    if (std::ranges::find(sections, "/nta") != sections.end()) {
+        *this = everything();
+        return;
+    }
+    std::ranges::sort(sections);
+    sections.erase(std::unique(sections.begin(), sections.end()), sections.end());
+}
+
+bool DocumentChange::affects(std::string_view xpath) const
+{
+    bool is_system = is_in_section(xpath, "/nta/system");
+    bool is_query = is_in_section(xpath, "/nta/queries");
+    for (const std::string& section : sections) {
+        // Everything can see the global declarations
+        if (section == "/nta" || section == "/nta/declaration" || is_in_section(xpath, section))
+            return true;
+        // The system instantiates templates and queries can refer to anything in the system
+        if (section.starts_with("/nta/template[") && (is_system || is_query))
+            return true;
+        if (section == "/nta/system" && is_query)
+            return true;
+    }
+    return false;
+}
+
+// Finds the end of the markup starting at xml[pos] == '<' while skipping quoted attribute values
+size_t find_markup_end(std::string_view xml, size_t pos)
+{
+    auto skip_to = [&](std::string_view terminator) {
+        auto end = xml.find(terminator, pos);
+        return end == std::string_view::npos ? xml.size() : end + terminator.size();
+    };
+    if (xml.substr(pos, 4) == "<!--")
+        return skip_to("-->");
+    if (xml.substr(pos, 9) == "<![CDATA[")
+        return skip_to("]]>");
+
+    char quote = '\0';
+    for (size_t i = pos + 1; i < xml.size(); ++i) {
+        if (quote != '\0') {
+            if (xml[i] == quote)
+                quote = '\0';
+        } else if (xml[i] == '"' || xml[i] == '\'') {
+            quote = xml[i];
+        } else if (xml[i] == '>') {
+            return i + 1;
+        }
+    }
+    return xml.size();
+}
+
+std::string_view element_name(std::string_view tag)
+{
+    tag.remove_prefix(tag.starts_with("</") ? 2 : 1);
+    return tag.substr(0, tag.find_first_of(" \t\r\n/>"));
+}
+
+size_t combine_hash(size_t seed, std::string_view text)
+{
+    // Whitespace between sections has no meaning, ignoring it keeps the hash stable when sections are removed
+    if (text.find_first_not_of(" \t\r\n") == std::string_view::npos)
+        return seed;
+    return seed ^ (std::hash<std::string_view>{}(text) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+std::string_view attribute_value(std::string_view tag, std::string_view name)
+{
+    for (auto pos = tag.find(name); pos != std::string_view::npos; pos = tag.find(name, pos + 1)) {
+        auto quote_pos = pos + name.size() + 1;
+        if (!std::isspace(static_cast<unsigned char>(tag[pos - 1])) || quote_pos >= tag.size() ||
+            tag[pos + name.size()] != '=')
+            continue;
+        auto end = tag.find(tag[quote_pos], quote_pos + 1);
+        return tag.substr(quote_pos + 1, end - quote_pos - 1);
+    }
+    return {};
+}
+
+// Elements which can occur multiple times below the same parent are numbered like "template[2]"
+bool is_numbered_element(std::string_view name)
+{
+    return name == "template" || name == "location" || name == "branchpoint" || name == "transition" ||
+           name == "nail" || name == "query";
+}
+
+void append_utf8(std::string& str, uint32_t code_point)
+{
+    if (code_point < 0x80) {
+        str += static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+        str += static_cast<char>(0xC0 | (code_point >> 6));
+        str += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        str += static_cast<char>(0xE0 | (code_point >> 12));
+        str += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        str += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else {
+        str += static_cast<char>(0xF0 | (code_point >> 18));
+        str += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+        str += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        str += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+}
+
+// Parses the code point of a numeric character reference like "#65" or "#x41", nullopt unless it is a valid one
+std::optional<uint32_t> parse_code_point(std::string_view entity)
+{
+    int base = entity.starts_with("#x") ? 16 : 10;
+    std::string_view digits = entity.substr(base == 16 ? 2 : 1);
+    uint32_t code_point;
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), code_point, base);
+    if (digits.empty() || error != std::errc{} || end != digits.data() + digits.size() || code_point > 0x10FFFF)
+        return std::nullopt;
+    return code_point;
+}
+
+std::string xml_unescape(std::string_view text)
+{
+    // Longest entity we understand is a code point like "#x10FFFF", the ';' is only searched for this far
+    constexpr size_t max_entity_length = 8;
+
+    std::string result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] != '&') {
+            result += text[i];
+            continue;
+        }
+        auto end = text.substr(0, i + max_entity_length + 2).find(';', i);
+        if (end == std::string_view::npos) {
+            result += text[i];
+            continue;
+        }
+        std::string_view entity = text.substr(i + 1, end - i - 1);
+        if (entity == "lt")
+            result += '<';
+        else if (entity == "gt")
+            result += '>';
+        else if (entity == "amp")
+            result += '&';
+        else if (entity == "quot")
+            result += '"';
+        else if (entity == "apos")
+            result += '\'';
+        else if (auto code_point = entity.starts_with("#") ? parse_code_point(entity) : std::nullopt)
+            append_utf8(result, *code_point);
+        else {
+            result += text[i];  // Unknown or malformed entities are kept verbatim
+            continue;
+        }
+        i = end;
+    }
+    return result;
+}
+
+void append_xml_escaped(std::string& xml, std::string_view text)
+{
+    for (char c : text) {
+        switch (c) {
+        case '<': xml += "&lt;"; break;
+        case '>': xml += "&gt;"; break;
+        case '&': xml += "&amp;"; break;
+        default: xml += c;
+        }
+    }
+}
+
+TextEdit Deserializer<TextEdit>::deserialize(const nlohmann::json& message)
+{
+    return {message["xpath"].get<std::string>(), message["offset"].get<uint32_t>(),
+            message["length"].get<uint32_t>(), message["text"].get<std::string>()};
+}
+
+TextEdit Deserializer<TextEdit>::deserialize(nlohmann::json& message)
+{
+    return {Deserializer<std::string>::deserialize(message["xpath"]), message["offset"].get<uint32_t>(),
+            message["length"].get<uint32_t>(), Deserializer<std::string>::deserialize(message["text"])};
+}
+
+void WorkingDocument::set_document(std::string_view xml)
+{
+    struct Element
+    {
+        std::string xpath;
+        std::unordered_map<std::string_view, int> child_count;
+    };
+
+    struct TextNode
+    {
+        size_t xpath_start;
+        size_t xpath_length;
+        NodeRef ref;
+    };
+
+    remove_spill_file();
+    pieces.clear();
+    markup.clear();
+    texts.clear();
+    xpath_buffer.clear();
+    text_nodes.clear();
+    sections = {{"/nta", 0, 0, 0}};
+
+    std::vector<Element> open_elements;
+    std::vector<TextNode> nodes;  // The keys of text_nodes can only point into xpath_buffer once it stops growing
+    size_t markup_start = 0;
+
+    auto end_markup = [&](size_t end) {
+        if (end > markup_start) {
+            pieces.push_back({markup.size(), end - markup_start, false});
+            markup.append(xml.substr(markup_start, end - markup_start));
+        }
+        markup_start = end;
+    };
+    auto begin_section = [&](std::string xpath, size_t start) {
+        end_markup(start);
+        sections.push_back({std::move(xpath), pieces.size(), 0, 0});
+    };
+
+    for (size_t pos = xml.find('<'); pos != std::string_view::npos; pos = xml.find('<', pos)) {
+        size_t end = find_markup_end(xml, pos);
+        std::string_view tag = xml.substr(pos, end - pos);
+
+        if (tag.starts_with("</")) {
+            if (!open_elements.empty())
+                open_elements.pop_back();
+            if (open_elements.size() == 1)
+                begin_section("/nta", end);
+        } else if (!tag.starts_with("<?") && !tag.starts_with("<!")) {
+            std::string_view name = element_name(tag);
+            std::string xpath = open_elements.empty() ? "" : open_elements.back().xpath;
+            xpath.append("/").append(name);
+            if (auto kind = attribute_value(tag, "kind"); !kind.empty())
+                xpath.append("[@kind=\"").append(kind).append("\"]");
+            else if (!open_elements.empty() && is_numbered_element(name))
+                xpath.append("[" + std::to_string(++open_elements.back().child_count[name]) + "]");
+
+            if (open_elements.size() == 1)
+                begin_section(xpath, pos);
+
+            if (tag.ends_with("/>")) {
+                if (open_elements.size() == 1)
+                    begin_section("/nta", end);
+            } else {
+                // An element only containing text becomes an editable text node
+                size_t text_end = xml.find('<', end);
+                bool is_text_node = text_end != std::string_view::npos && xml.substr(text_end, 2) == "</" &&
+                                    element_name(xml.substr(text_end)) == name;
+                if (is_text_node) {
+                    end_markup(end);
+                    nodes.push_back({xpath_buffer.size(), xpath.size(), {texts.size(), sections.size() - 1}});
+                    xpath_buffer += xpath;
+                    pieces.push_back({texts.size(), 0, true});
+                    texts.push_back(xml_unescape(xml.substr(end, text_end - end)));
+                    markup_start = text_end;
+                    end = text_end;
+                }
+                open_elements.push_back({std::move(xpath), {}});
+            }
+        }
+        pos = end;
+    }
+    end_markup(xml.size());
+    markup.shrink_to_fit();
+    xpath_buffer.shrink_to_fit();
+
+    text_nodes.reserve(nodes.size());
+    for (const TextNode& node : nodes) {
+        auto xpath = std::string_view{xpath_buffer}.substr(node.xpath_start, node.xpath_length);
+        text_nodes.insert_or_assign(xpath, node.ref);
+    }
+
+    for (size_t i = 0; i < sections.size(); ++i) {
+        size_t end = i + 1 < sections.size() ? sections[i + 1].first_piece : pieces.size();
+        for (size_t piece = sections[i].first_piece; piece < end; ++piece) {
+            if (!pieces[piece].is_text) {
+                auto content = std::string_view{markup}.substr(pieces[piece].start, pieces[piece].length);
+                sections[i].markup_hash = combine_hash(sections[i].markup_hash, content);
+            }
+        }
+        update_hash(i);
+    }
 }
 
-void WorkingDocument::insert(std::string str, int offset)
+void WorkingDocument::apply_edit(const TextEdit& edit)
 {
-    int decl_start = document.find("<declaration>") + 13;
-    document = document.substr(0, decl_start + offset) + str + document.substr(decl_start + offset);
+    std::string_view xpath = edit.xpath;
+    if (xpath.ends_with('!'))
+        xpath.remove_suffix(1);
+
+    auto node = text_nodes.find(xpath);
+    if (node == text_nodes.end())
+        throw std::invalid_argument{"No text node at " + edit.xpath};
+
+    std::string& text = texts[node->second.text];
+    if (edit.offset > text.size() || edit.length > text.size() - edit.offset)
+        throw std::out_of_range{"Edit is outside of " + edit.xpath};
+
+    text.replace(edit.offset, edit.length, edit.text);
+    update_hash(node->second.section);
 }
 
-void WorkingDocument::remove(int offset, int length)
+std::string_view WorkingDocument::get_text(std::string_view xpath) const
 {
-    offset += document.find("<declaration>") + 12;
-    while (length-- > 0)
-        document[++offset] = ' ';  // Replace with whitespace to avoid shifting contents
-}
\ No newline at end of file
+    if (xpath.ends_with('!'))
+        xpath.remove_suffix(1);
+
+    auto node = text_nodes.find(xpath);
+    if (node == text_nodes.end())
+        throw std::invalid_argument{"No text node at " + std::string{xpath}};
+    return texts[node->second.text];
+}
+
+std::string read_spill_file(const std::filesystem::path& file, size_t size)
+{
+    auto content = std::string(size, '\0');
+    auto stream = std::ifstream{file, std::ios::binary};
+    stream.read(content.data(), static_cast<std::streamsize>(size));
+    if (!stream)
+        throw std::runtime_error{"Could not read the spilled markup in " + file.string()};
+    return content;
+}
+
+std::string WorkingDocument::to_xml() const
+{
+    std::string spilled;
+    std::string_view source = markup;
+    if (is_spilled()) {
+        spilled = read_spill_file(spill_file, spilled_size);
+        source = spilled;
+    }
+
+    size_t size = source.size();
+    for (const std::string& text : texts)
+        size += text.size();
+
+    std::string xml;
+    xml.reserve(size + size / 16);  // Leave room for escaping
+    for (const Piece& piece : pieces) {
+        if (piece.is_text)
+            append_xml_escaped(xml, texts[piece.start]);
+        else
+            xml += source.substr(piece.start, piece.length);
+    }
+    return xml;
+}
+
+size_t WorkingDocument::memory_usage() const
+{
+    auto stats = get_memory_stats();
+    return stats.markup + stats.spilled_markup + stats.text + stats.xpaths;
+}
+
+WorkingDocument::MemoryStats WorkingDocument::get_memory_stats() const
+{
+    auto stats = MemoryStats{is_spilled() ? 0 : markup.capacity(), spilled_size, 0, xpath_buffer.capacity(), 0};
+    for (const std::string& text : texts)
+        stats.text += text.capacity();
+    stats.pieces = pieces.capacity() * sizeof(Piece) + sections.capacity() * sizeof(Section) +
+                   texts.capacity() * sizeof(std::string) +
+                   text_nodes.size() * (sizeof(std::string_view) + sizeof(NodeRef));
+    return stats;
+}
+
+bool WorkingDocument::spill_markup(const std::filesystem::path& file)
+{
+    if (is_spilled())
+        return true;
+
+    auto stream = std::ofstream{file, std::ios::binary | std::ios::trunc};
+    stream.write(markup.data(), static_cast<std::streamsize>(markup.size()));
+    stream.close();
+    if (!stream) {
+        std::error_code error;
+        std::filesystem::remove(file, error);
+        return false;
+    }
+    spill_file = file;
+    spilled_size = markup.size();
+    markup = std::string{};  // Clearing alone would keep the buffer
+    return true;
+}
+
+void WorkingDocument::restore_markup()
+{
+    if (!is_spilled())
+        return;
+    markup = read_spill_file(spill_file, spilled_size);
+    remove_spill_file();
+}
+
+void WorkingDocument::remove_spill_file()
+{
+    if (spill_file.empty())
+        return;
+    std::error_code error;
+    std::filesystem::remove(spill_file, error);
+    spill_file.clear();
+    spilled_size = 0;
+}
+
+void WorkingDocument::update_hash(size_t section)
+{
+    size_t end = section + 1 < sections.size() ? sections[section + 1].first_piece : pieces.size();
+    size_t hash = sections[section].markup_hash;
+    for (size_t i = sections[section].first_piece; i < end; ++i) {
+        if (pieces[i].is_text)
+            hash = combine_hash(hash, texts[pieces[i].start]);
+    }
+    sections[section].hash = hash;
+}
+
+std::unordered_map<std::string, size_t> WorkingDocument::section_hashes() const
+{
+    // Everything outside of the sections is combined into a single "/nta" section, empty parts are skipped
+    std::unordered_map<std::string, size_t> hashes;
+    for (const Section& section : sections) {
+        auto [it, is_new] = hashes.try_emplace(section.xpath, section.hash);
+        if (!is_new && section.hash != 0)
+            it->second = combine_hash(it->second, std::to_string(section.hash));
+    }
+    return hashes;
+}
+
+DocumentChange WorkingDocument::get_changes() const { return get_changes(section_hashes()); }
+
+DocumentChange WorkingDocument::get_changes(const std::unordered_map<std::string, size_t>& hashes) const
+{
+    if (parsed_sections.empty())
+        return DocumentChange::everything();
+
+    auto change = DocumentChange{};
+    for (const auto& [xpath, hash] : hashes) {
+        auto parsed = parsed_sections.find(xpath);
+        if (parsed == parsed_sections.end() || parsed->second != hash)
+            change.sections.push_back(xpath);
+    }
+    // Removed sections count as changed too, e.g. deleting the last template
+    for (const auto& [xpath, hash] : parsed_sections) {
+        if (!hashes.contains(xpath))
+            change.sections.push_back(xpath);
+    }
+    std::ranges::sort(change.sections);
+    return change;
+}
+
+WorkingDocument::Revision WorkingDocument::get_revision() const
+{
+    auto hashes = section_hashes();
+    auto change = get_changes(hashes);
+    return {to_xml(), std::move(hashes), std::move(change)};
+}
+
+std::unique_ptr<UTAP::Document> WorkingDocument::Revision::parse() const
+{
+    auto doc = std::make_unique<UTAP::Document>();
+    parse_XML_buffer(xml.c_str(), doc.get(), true, {});
+    return doc;
+}
+
+std::unique_ptr<UTAP::Document> WorkingDocument::parse()
+{
+    auto revision = get_revision();
+    auto doc = revision.parse();
+    set_parsed(revision);
+    return doc;
+}
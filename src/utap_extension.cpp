@@ -4,27 +4,26 @@
 #include <charconv>
 #include <iterator>
 #include <cstring>
+#include <algorithm>
 
-// Likely undefined behaviour here, release is failing but debug is succeeding
+UTAP::declarations_t& navigate_xpath(DocumentSnapshot& snapshot, std::string_view path)
+{
+    return snapshot.get<ScopeTable>().resolve(path);
+}
 
-UTAP::declarations_t& navigate_template(UTAP::Document& doc, std::string_view path)
+UTAP::declarations_t& navigate_xpath(DocumentSnapshot& snapshot, std::string_view path, uint32_t pos)
 {
-    int num_size = path.find_first_of(']');
-    int template_index;
-    auto result = std::from_chars(path.begin(), path.begin() + num_size, template_index);
-    // These two exceptions reflect the behavior of std::stoi.
-    if (result.ec == std::errc::invalid_argument) {
-        throw std::invalid_argument{"invalid_argument"};
-    } else if (result.ec == std::errc::result_out_of_range) {
-        throw std::out_of_range{"out_of_range"};
-    }
+    return snapshot.get<ScopeTable>().resolve(path, pos);
+}
 
-    auto template_it = doc.get_templates().begin();
-    std::advance(template_it, template_index - 1);
-    return *template_it;
+ScopeTable::ScopeTable(DocumentSnapshot& snapshot):
+    doc{snapshot.get_document()}, positions{snapshot.get<PositionTable>()}
+{
+    for (UTAP::template_t& templ : doc.get_templates())
+        templates.push_back(&templ);
 }
 
-UTAP::declarations_t& navigate_xpath(UTAP::Document& doc, std::string_view path)
+UTAP::declarations_t& ScopeTable::parse(std::string_view path) const
 {
     if (path.substr(0, 5) != "/nta/")
         throw std::invalid_argument{"Xpath did not start with '/nta/'"};
@@ -35,37 +34,112 @@ UTAP::declarations_t& navigate_xpath(UTAP::Document& doc, std::string_view path)
     else if (path.starts_with("system!"))
         return doc.get_system_declarations();
     else if (path.starts_with("template["))
-        return navigate_template(doc, path.substr(9));
+        return get_template(path.substr(9));
     else if (path.starts_with("queries!"))  // Hard coded special case, due to weird handling of queries
         return doc.get_system_declarations();
 
     throw std::invalid_argument{"Path did not match anything"};
 }
 
-UTAP::declarations_t& navigate_xpath(UTAP::Document& doc, std::string_view path, uint32_t pos)
+UTAP::template_t& ScopeTable::get_template(std::string_view path) const
+{
+    size_t index = 0;
+    size_t end = path.find(']');
+    if (end == std::string_view::npos)
+        throw std::invalid_argument{"Template index is not closed by ']'"};
+    auto result = std::from_chars(path.data(), path.data() + end, index);
+    if (result.ec == std::errc::result_out_of_range)
+        throw std::out_of_range{"Template index out of range"};
+    if (result.ec != std::errc{} || result.ptr != path.data() + end)
+        throw std::invalid_argument{"Template index is not a number"};
+    if (index == 0 || index > templates.size())
+        throw std::out_of_range{"Template index out of range"};
+    return *templates[index - 1];
+}
+
+UTAP::declarations_t& ScopeTable::resolve(std::string_view path)
+{
+    auto lock = std::lock_guard{mutex};
+    if (auto it = scopes.find(path); it != scopes.end())
+        return *it->second;
+
+    UTAP::declarations_t& decls = parse(path);
+    scopes.emplace(path, &decls);
+    return decls;
+}
+
+UTAP::declarations_t& ScopeTable::resolve(std::string_view path, uint32_t pos)
 {
     if (path == "/nta/")
         return doc.get_globals();
 
-    UTAP::declarations_t& decl = navigate_xpath(doc, path);
+    UTAP::declarations_t& decls = resolve(path);
+    auto lock = std::lock_guard{mutex};
+    auto [it, is_new] = function_bodies.try_emplace(&decls);
+    if (is_new)
+        it->second = index_functions(decls.functions);
+
+    // Bodies on the same level do not overlap, so only the last one starting before pos can contain it
+    UTAP::declarations_t* innermost = &decls;
+    const std::vector<FunctionBody>* bodies = &it->second;
+    while (true) {
+        auto next = std::ranges::upper_bound(*bodies, pos, {}, &FunctionBody::begin);
+        if (next == bodies->begin() || pos > std::prev(next)->end)
+            return *innermost;
+        innermost = std::prev(next)->body;
+        bodies = &std::prev(next)->nested;
+    }
+}
 
-    for (auto& func : decl.functions) {
-        TextRange range{doc, func.body_position};
-        if (range.contains(pos))
-            return *func.body;
+std::vector<ScopeTable::FunctionBody> ScopeTable::index_functions(std::list<UTAP::function_t>& functions) const
+{
+    std::vector<FunctionBody> bodies;
+    bodies.reserve(functions.size());
+    for (UTAP::function_t& func : functions) {
+        auto range = TextRange{positions, func.body_position};
+        bodies.push_back({range.begOffset, range.endOffset, func.body.get(), index_functions(func.body->functions)});
     }
+    std::ranges::sort(bodies, {}, &FunctionBody::begin);
+    return bodies;
+}
 
-    return decl;
+std::optional<std::reference_wrapper<UTAP::template_t>> find_process(DocumentSnapshot& snapshot, std::string_view name)
+{
+    return snapshot.get<SymbolIndex>().find_process(name);
+}
+
+SymbolIndex::SymbolIndex(DocumentSnapshot& snapshot):
+    doc{snapshot.get_document()}, positions{snapshot.get<PositionTable>()}
+{
+    for (auto& process : doc.get_processes())
+        processes.emplace(process.uid.get_name(), process.templ);
 }
 
-std::optional<std::reference_wrapper<UTAP::template_t>> find_process(UTAP::Document& doc, std::string_view name)
+const SymbolIndex::Scope& SymbolIndex::get_scope(UTAP::declarations_t& decls)
 {
-    for (auto& process : doc.get_processes()) {
-        if (process.uid.get_name() == name) {
-            if (process.templ)
-                return *process.templ;
-            return std::nullopt;
-        }
+    auto lock = std::lock_guard{mutex};
+    auto [it, is_new] = scopes.try_emplace(&decls);
+    if (is_new) {
+        // Inner scopes are visited first so the first symbol with a given name shadows the rest
+        DeclarationsWalker{positions, false}.visit_symbols(decls, [&](UTAP::symbol_t& symbol, const TextRange&) {
+            it->second.emplace(symbol.get_name(), symbol);
+            return false;
+        });
     }
+    return it->second;
+}
+
+std::optional<UTAP::symbol_t> SymbolIndex::find(UTAP::declarations_t& decls, std::string_view name)
+{
+    const Scope& scope = get_scope(decls);
+    if (auto it = scope.find(name); it != scope.end())
+        return it->second;
+    return std::nullopt;
+}
+
+std::optional<std::reference_wrapper<UTAP::template_t>> SymbolIndex::find_process(std::string_view name) const
+{
+    if (auto it = processes.find(name); it != processes.end() && it->second != nullptr)
+        return *it->second;
     return std::nullopt;
 }
\ No newline at end of file
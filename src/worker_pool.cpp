@@ -0,0 +1,130 @@
+#include <uls/worker_pool.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+WorkerPool::WorkerPool(size_t thread_count)
+{
+    threads.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; ++i)
+        threads.emplace_back([this] { run_worker(); });
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        auto lock = std::lock_guard{mutex};
+        is_stopping = true;
+    }
+    task_added.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+void WorkerPool::run_worker()
+{
+    auto lock = std::unique_lock{mutex};
+    while (true) {
+        task_added.wait(lock, [this] { return is_stopping || !tasks.empty(); });
+        if (tasks.empty())
+            return;
+
+        Task task = std::move(tasks.front());
+        tasks.pop_front();
+        lock.unlock();
+        task.run();
+        lock.lock();
+    }
+}
+
+void WorkerPool::submit(nlohmann::json id, std::function<void()> run, std::function<void()> on_cancel)
+{
+    {
+        auto lock = std::lock_guard{mutex};
+        tasks.push_back({std::move(id), std::move(run), std::move(on_cancel)});
+    }
+    task_added.notify_one();
+}
+
+bool WorkerPool::cancel(const nlohmann::json& id)
+{
+    std::vector<Task> cancelled;
+    {
+        auto lock = std::lock_guard{mutex};
+        auto is_cancelled = [&](const Task& task) { return task.id == id; };
+        auto first = std::stable_partition(tasks.begin(), tasks.end(), std::not_fn(is_cancelled));
+        std::move(first, tasks.end(), std::back_inserter(cancelled));
+        tasks.erase(first, tasks.end());
+    }
+
+    for (Task& task : cancelled)
+        task.on_cancel();
+    return !cancelled.empty();
+}
+
+namespace {
+/** The state of one parallel_for, helpers may only pick it up after the call returned */
+struct ParallelFor
+{
+    const std::function<void(size_t)>* task;
+    size_t count;
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::condition_variable helpers_done;
+    size_t running_helpers{0};
+    std::exception_ptr error;
+
+    void run()
+    {
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                (*task)(i);
+            } catch (...) {
+                auto lock = std::lock_guard{mutex};
+                if (error == nullptr)
+                    error = std::current_exception();
+            }
+        }
+    }
+};
+
+size_t helper_count() { return std::max(1U, std::thread::hardware_concurrency()) - 1; }
+
+/** Shared by all calls such that concurrent requests do not each start a thread per core */
+WorkerPool& helper_pool()
+{
+    static WorkerPool pool{helper_count()};
+    return pool;
+}
+}  // namespace
+
+void parallel_for(size_t count, const std::function<void(size_t)>& task, size_t max_threads)
+{
+    auto state = std::make_shared<ParallelFor>(&task, count);
+    size_t helpers = std::min({helper_count(), std::max<size_t>(max_threads, 1) - 1, count > 0 ? count - 1 : 0});
+
+    // Helpers busy with other calls start late or not at all, the calling thread then does the remaining work
+    for (size_t i = 0; i < helpers; ++i) {
+        auto help = [state] {
+            {
+                auto lock = std::lock_guard{state->mutex};
+                ++state->running_helpers;
+            }
+            state->run();
+            {
+                auto lock = std::lock_guard{state->mutex};
+                --state->running_helpers;
+            }
+            state->helpers_done.notify_all();
+        };
+        helper_pool().submit(nullptr, std::move(help), [] {});
+    }
+    state->run();
+
+    // Helpers starting from now on find no indices left and never call the task
+    auto lock = std::unique_lock{state->mutex};
+    state->helpers_done.wait(lock, [&] { return state->running_helpers == 0; });
+    if (state->error != nullptr)
+        std::rethrow_exception(state->error);
+}
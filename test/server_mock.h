@@ -3,6 +3,8 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <cstdint>
 
 #define CHECK_EOF(mock)           \
     CHECK(mock.read_raw() == ""); \
@@ -22,6 +24,11 @@ struct MockIO : IOStream
 
     void send_cmd(const std::string& cmd) { in_buf << nlohmann::json{{"cmd", cmd}, {"args", ""}} << std::endl; }
 
+    void send_request(const nlohmann::json& id, const std::string& cmd, const nlohmann::json& args)
+    {
+        in_buf << nlohmann::json{{"id", id}, {"cmd", cmd}, {"args", args}} << std::endl;
+    }
+
     nlohmann::json receive()
     {
         nlohmann::json message;
@@ -29,11 +36,43 @@ struct MockIO : IOStream
         return message["info"];
     }
 
+    /** Sends a CBOR message framed by its size, must be preceded by switching the wire format */
+    void send_frame(const nlohmann::json& message)
+    {
+        std::vector<uint8_t> payload = nlohmann::json::to_cbor(message);
+        auto size = static_cast<uint32_t>(payload.size());
+        for (int i = 0; i < 4; ++i)
+            in_buf.put(static_cast<char>(size >> (24 - 8 * i)));
+        in_buf.write(reinterpret_cast<const char*>(payload.data()), static_cast<std::streamsize>(payload.size()));
+    }
+
+    nlohmann::json receive_frame()
+    {
+        // Skips the newline ending the last json message, frames in tests are too short to start with one
+        if (out_buf.peek() == '\n')
+            out_buf.get();
+
+        uint32_t size = 0;
+        for (int i = 0; i < 4; ++i)
+            size = size << 8 | static_cast<uint8_t>(out_buf.get());
+        std::vector<uint8_t> payload(size);
+        out_buf.read(reinterpret_cast<char*>(payload.data()), static_cast<std::streamsize>(size));
+        return nlohmann::json::from_cbor(payload);
+    }
+
+    /** The entire message including its id and type */
+    nlohmann::json receive_message()
+    {
+        nlohmann::json message;
+        out_buf >> message;
+        return message;
+    }
+
     bool expect_error()
     {
         nlohmann::json message;
         out_buf >> message;
-        return message["type"] == "err";
+        return message["res"] == "err";
     }
 
     bool out_eof() { return out_buf.eof(); }
@@ -3,10 +3,12 @@
 #include <vector>
 #include <ranges>
 #include <iterator>
+#include <algorithm>
 
 #include <iostream>
 #include <stdexcept>
 #include <concepts>
+#include <chrono>
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
@@ -137,6 +139,37 @@ TEST_CASE("Autocomplete test default items")
     CHECK_EOF(mock);
 }
 
+TEST_CASE("Autocomplete guard only suggests guard keywords, variables and functions")
+{
+    auto repo = SystemRepository{};
+    auto autocomplete = AutocompleteModule{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("autocomplete", {{"xpath", "/nta/template[1]/transition[1]/label[@kind=\"guard\"]"},
+                               {"identifier", ""},
+                               {"offset", 0}});
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(autocomplete).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    auto results = mock.receive();
+    auto names = name_view(results);
+    CHECK(names[0] == "true");
+    CHECK(names[1] == "false");
+    CHECK(names[2] == "abs");
+    CHECK(find(results, "abs")["type"] == "function");
+    CHECK(find(results, "p_a")["type"] == "variable");
+    CHECK(find(results, "y")["type"] == "variable");
+    CHECK_THROWS(find(results, "int"));
+    CHECK_THROWS(find(results, "point"));
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
 TEST_CASE("Autocomplete struct type")
 {
     auto repo = SystemRepository{};
@@ -225,6 +258,114 @@ TEST_CASE("Autocomplete template sub members")
     CHECK_EOF(mock);
 }
 
+TEST_CASE("Autocomplete with limit only returns best matches")
+{
+    auto repo = SystemRepository{};
+    auto autocomplete = AutocompleteModule{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "p"}, {"offset", 147}, {"limit", 10}});
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "p"}, {"offset", 147}, {"limit", 2}});
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "p_a.y"}, {"offset", 147}, {"limit", 2}});
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"},
+                               {"identifier", "p_a.y"},
+                               {"offset", 147},
+                               {"limit", 1'000'000'000'000}});
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "p"}, {"offset", 147}, {"limit", 0}});
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "p"}, {"offset", 147}, {"limit", -1}});
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "p"}, {"offset", 147}, {"limit", "2"}});
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(autocomplete).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    // Globals starting with p come before the builtin pow, which comes before names only containing a p
+    json best = name_view(mock.receive());
+    REQUIRE(best.size() == 10);
+    auto globals = json{"p_a", "point"};
+    CHECK(std::is_permutation(best.begin(), best.begin() + 2, globals.begin(), globals.end()));
+    CHECK(best[2] == "pow");
+    CHECK(name_view(mock.receive()) == json{best[0], best[1]});
+    CHECK(name_view(mock.receive()) == json{"p_a.y"});
+    // Limits larger than the number of matches are not allocated up front
+    CHECK(name_view(mock.receive()) == json{"p_a.y"});
+    CHECK(mock.expect_error());
+    CHECK(mock.expect_error());
+    CHECK(mock.expect_error());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+const std::string RANKING_MODEL = R"(<?xml version="1.0" encoding="utf-8"?>
+<!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
+<nta>
+    <declaration>int count;
+int cell;
+int totalCount = count + count;</declaration>
+	<template>
+		<name x="5" y="5">Template</name>
+		<declaration>int cursor;
+void f() { int c = count; }</declaration>
+		<location id="id0" x="-76" y="-68">
+		</location>
+		<init ref="id0"/>
+	</template>
+	<system>system Template;</system>
+</nta>)";
+
+TEST_CASE("Autocomplete with limit ranks fuzzy matches by scope and usages")
+{
+    auto repo = SystemRepository{};
+    auto autocomplete = AutocompleteModule{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", RANKING_MODEL);
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "c"}, {"offset", 52}, {"limit", 2}});
+    mock.send("autocomplete",
+              {{"xpath", "/nta/template[1]/declaration!"}, {"identifier", "c"}, {"offset", 11}, {"limit", 3}});
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "tC"}, {"offset", 52}, {"limit", 1}});
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(autocomplete).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    // count is used, so it beats the shorter cell
+    CHECK(name_view(mock.receive()) == json{"count", "cell"});
+    // Symbols of the template come before the globals
+    CHECK(name_view(mock.receive()) == json{"cursor", "count", "cell"});
+    // Matches the start of each camelCase word
+    CHECK(name_view(mock.receive()) == json{"totalCount"});
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Autocomplete waits for background parse of first upload")
+{
+    auto repo = SystemRepository{};
+    repo.enable_background_parsing(std::chrono::milliseconds{10});
+    auto autocomplete = AutocompleteModule{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("autocomplete", {{"xpath", "/nta/declaration!"}, {"identifier", "p_a."}, {"offset", 77}});
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(autocomplete).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    auto results = mock.receive();
+    CHECK(name_view(results) == json{"p_a.x", "p_a.y", "p_a.z"});
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
 const std::string MODEL2 = R"(<?xml version="1.0" encoding="utf-8"?>
 <!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
 <nta>
@@ -0,0 +1,146 @@
+#include <uls/common_data.h>
+#include <uls/system.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+using json = nlohmann::json;
+
+const std::string MODEL = R"(<?xml version="1.0" encoding="utf-8"?>
+<!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
+<nta>
+    <declaration>
+int x = 5;
+int y = 6;
+    </declaration>
+	<template>
+		<name x="5" y="5">Template</name>
+		<declaration>int a = x;
+int b = y;</declaration>
+		<location id="id0" x="-76" y="-68">
+			<name x="-86" y="-102">Init</name>
+		</location>
+		<init ref="id0"/>
+	</template>
+	<system>
+p = Template();
+system p;
+</system>
+</nta>)";
+
+std::shared_ptr<DocumentSnapshot> parse(const std::string& model)
+{
+    auto doc = WorkingDocument{};
+    doc.set_document(model);
+    return std::make_shared<DocumentSnapshot>(doc.parse(), 1);
+}
+
+UTAP::position_t find_variable(UTAP::declarations_t& decls, std::string_view name)
+{
+    auto it = std::ranges::find_if(decls.variables,
+                                   [&](const UTAP::variable_t& var) { return var.uid.get_name() == name; });
+    REQUIRE(it != decls.variables.end());
+    return it->uid.get_position();
+}
+
+TEST_CASE("Node starts are looked up once per node")
+{
+    auto snapshot = parse(MODEL);
+    UTAP::Document& doc = snapshot->get_document();
+    auto& positions = snapshot->get<PositionTable>();
+    auto x = find_variable(doc.get_globals(), "x");
+    auto y = find_variable(doc.get_globals(), "y");
+    auto a = find_variable(doc.get_templates().front(), "a");
+
+    const auto& start = positions.find_node_start(x.start);
+    CHECK(start.position == doc.find_first_position(x.start).position);
+    CHECK(*start.path == "/nta/declaration");
+
+    // Positions on later lines of the node share the cached start of the node
+    CHECK(&positions.find_node_start(y.start) == &start);
+    CHECK(&positions.find_node_start(a.start) != &start);
+    CHECK(positions.find_node_start(a.start).position == doc.find_first_position(a.start).position);
+}
+
+TEST_CASE("Text locations are relative to the start of their node")
+{
+    auto snapshot = parse(MODEL);
+    UTAP::Document& doc = snapshot->get_document();
+    auto& positions = snapshot->get<PositionTable>();
+    auto y = find_variable(doc.get_globals(), "y");
+    auto b = find_variable(doc.get_templates().front(), "b");
+
+    auto global = TextLocation{positions, y};
+    CHECK(Serializer<TextLocation>::serialize(global) ==
+          json{{"xpath", "/nta/declaration"}, {"start", 16}, {"end", 17}});
+
+    auto local = TextLocation{positions, b};
+    CHECK(Serializer<TextLocation>::serialize(local) ==
+          json{{"xpath", "/nta/template[1]/declaration"}, {"start", 15}, {"end", 16}});
+
+    // The path is not copied, it points at the path held by the document
+    CHECK(global.path == positions.find_node_start(y.start).path.get());
+    CHECK(local.path == doc.find_first_position(b.start).path.get());
+}
+
+/** Where the next small allocation of the arena goes, which for a fresh arena is the start of its buffer */
+std::byte* next_allocation(RequestArena& arena) { return static_cast<std::byte*>(arena.get()->allocate(8)); }
+
+bool is_within(std::byte* pointer, std::byte* buffer) { return buffer <= pointer && pointer < buffer + 64 * 1024; }
+
+TEST_CASE("Request arenas reuse the buffer of their thread")
+{
+    std::byte* buffer;
+    {
+        auto arena = RequestArena{};
+        buffer = next_allocation(arena);
+    }
+    auto arena = RequestArena{};
+    CHECK(next_allocation(arena) == buffer);
+
+    // Requests running on another thread have a buffer of their own
+    std::byte* other = nullptr;
+    std::thread{[&] {
+        auto arena = RequestArena{};
+        other = next_allocation(arena);
+    }}.join();
+    REQUIRE(other != nullptr);
+    CHECK_FALSE(is_within(other, buffer));
+}
+
+TEST_CASE("Nested request arenas allocate on the heap")
+{
+    std::byte* buffer;
+    {
+        auto outer = RequestArena{};
+        buffer = next_allocation(outer);
+        {
+            auto nested = RequestArena{};
+            CHECK_FALSE(is_within(next_allocation(nested), buffer));
+        }
+
+        // The outer arena still owns the thread buffer after the nested one is gone
+        auto nested = RequestArena{};
+        CHECK_FALSE(is_within(next_allocation(nested), buffer));
+        CHECK(is_within(next_allocation(outer), buffer));
+    }
+    auto arena = RequestArena{};
+    CHECK(next_allocation(arena) == buffer);
+}
+
+TEST_CASE("Request arenas fall back to the heap when the thread buffer is full")
+{
+    auto arena = RequestArena{};
+    std::byte* buffer = next_allocation(arena);
+    auto* large = static_cast<std::byte*>(arena.get()->allocate(128 * 1024));
+    CHECK_FALSE(is_within(large, buffer));
+    large[128 * 1024 - 1] = std::byte{1};
+}
@@ -0,0 +1,92 @@
+#include "server_mock.h"
+#include <uls/diagnostics.h>
+
+#include <string>
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+using json = nlohmann::json;
+
+const std::string MODEL = R"(<?xml version="1.0" encoding="utf-8"?>
+<!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
+<nta>
+    <declaration>int x = 5;</declaration>
+	<template>
+		<name x="5" y="5">Template</name>
+		<declaration>int y = unknown;</declaration>
+		<location id="id0" x="-76" y="-68"/>
+		<init ref="id0"/>
+	</template>
+	<system>
+p = Template();
+system p;
+</system>
+</nta>)";
+
+std::string replace(std::string str, std::string_view from, std::string_view to)
+{
+    return str.replace(str.find(from), from.size(), to);
+}
+
+TEST_CASE("Diagnostics are only sent for nodes that changed")
+{
+    auto repo = SystemRepository{};
+    auto diagnostics = DiagnosticsModule{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("upload", replace(MODEL, "int x = 5;", "int x = 6;"));  // Same error as before
+    mock.send("upload", replace(MODEL, "unknown", "x"));
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(diagnostics).start();
+
+    REQUIRE(mock.handshake());
+    auto first = mock.receive_message();
+    REQUIRE(first["res"] == "notif/diagnostics");
+    REQUIRE(first["info"].size() == 1);
+    const json& errors = first["info"]["/nta/template[1]/declaration"];
+    REQUIRE(errors.size() == 1);
+    CHECK(errors[0]["severity"] == "error");
+    CHECK(errors[0]["start"] == 8);
+    CHECK(errors[0]["end"] == 15);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    // Fixing the error clears the node
+    CHECK(mock.receive() == json{{"/nta/template[1]/declaration", json::array()}});
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Diagnostics are compared with those last sent for the same document")
+{
+    auto repo = SystemRepository{};
+    auto diagnostics = DiagnosticsModule{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("select_document", "b");
+    mock.send("upload", replace(MODEL, "unknown", "x"));  // Nothing to clear in b
+    mock.send("select_document", "");  // The error of "" was already sent
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(diagnostics).start();
+
+    REQUIRE(mock.handshake());
+    auto first = mock.receive_message();
+    REQUIRE(first["res"] == "notif/diagnostics");
+    CHECK(first["info"].contains("/nta/template[1]/declaration"));
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == FAIL_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
@@ -4,6 +4,7 @@
 #include <uls/system.h>
 
 #include <iostream>
+#include <algorithm>
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
@@ -107,4 +108,119 @@ TEST_CASE("typedef in template declaration")
     // Exit
     REQUIRE(mock.receive() == OK_RESPONSE);
     CHECK_EOF(mock);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Keyword notifications hold the full list by default")
+{
+    auto repo = SystemRepository{};
+    auto highlight = Highlight{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("change_node", "/nta/system!");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(highlight).start();
+
+    REQUIRE(mock.handshake());
+    auto first = mock.receive_message();
+    REQUIRE(first["res"] == "notif/keywords");
+    CHECK(first["info"].size() == 7);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    // The system cannot see the typedefs of the template
+    auto second = mock.receive_message();
+    REQUIRE(second["res"] == "notif/keywords");
+    CHECK(second["info"].size() == 5);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Later keyword notifications only hold the changes once diffs are enabled")
+{
+    auto repo = SystemRepository{};
+    auto highlight = Highlight{repo};
+    auto renamed = MODEL;
+    renamed.replace(renamed.find("typedef int x;"), 14, "typedef int z;");
+
+    auto mock = MockIO{};
+    mock.send_cmd("enable_keyword_diffs");
+    mock.send("upload", MODEL);
+    mock.send("upload", renamed);
+    mock.send("change_node", "/nta/system!");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(highlight).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    auto first = mock.receive_message();
+    REQUIRE(first["res"] == "notif/keywords");
+    REQUIRE(first["info"].size() == 7);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    auto diff = mock.receive_message();
+    REQUIRE(diff["res"] == "notif/keywords_diff");
+    REQUIRE(diff["info"]["added"].size() == 1);
+    CHECK(diff["info"]["added"][0]["id"] == "z");
+    REQUIRE(diff["info"]["removed"].size() == 1);
+    CHECK(diff["info"]["removed"][0]["id"] == "x");
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    // The system cannot see the typedefs of the template
+    diff = mock.receive_message();
+    REQUIRE(diff["res"] == "notif/keywords_diff");
+    CHECK(diff["info"]["added"].empty());
+    CHECK(diff["info"]["removed"].size() == 2);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Semantic tokens of a viewport are delta encoded")
+{
+    auto repo = SystemRepository{};
+    auto highlight = Highlight{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("semantic_tokens", {{"xpath", "/nta/template[1]/declaration!"}});
+    mock.send("semantic_tokens", {{"xpath", "/nta/template[1]/declaration!"}, {"start", 20}});
+    mock.send("semantic_tokens", {{"xpath", "/nta/template[1]/declaration!"}, {"start", 0}, {"end", 20}});
+    mock.send("semantic_tokens", {{"xpath", "/nta/template[2]/declaration!"}});
+    mock.send_cmd("semantic_tokens");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(highlight).start();
+
+    REQUIRE(mock.handshake());
+    mock.receive();  // Keywords notification
+    REQUIRE(mock.receive() == OK_RESPONSE);
+
+    auto viewport = mock.receive();
+    auto type = std::ranges::find(viewport["legend"], "type") - viewport["legend"].begin();
+    CHECK(viewport["nodes"] == json{{"/nta/template[1]/declaration", {12, 1, type, 14, 1, type}}});
+
+    viewport = mock.receive();
+    CHECK(viewport["nodes"] == json{{"/nta/template[1]/declaration", {26, 1, type}}});
+
+    viewport = mock.receive();
+    CHECK(viewport["nodes"] == json{{"/nta/template[1]/declaration", {12, 1, type}}});
+
+    // Nodes without tokens, like one that does not exist, are left out
+    viewport = mock.receive();
+    CHECK(viewport["nodes"] == json::object());
+
+    auto all = mock.receive();
+    CHECK(all["nodes"]["/nta/template[1]/declaration"] == json{12, 1, type, 14, 1, type});
+    CHECK(all["nodes"].contains("/nta/system"));
+
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
@@ -1,6 +1,8 @@
 #include "server_mock.h"
 #include <uls/renaming.h>
 
+#include <algorithm>
+#include <future>
 #include <iostream>
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
@@ -129,6 +131,77 @@ TEST_CASE("Find usages inside types")
     CHECK_EOF(mock);
 }
 
+TEST_CASE("Find usages pages its results")
+{
+    auto repo = SystemRepository{};
+    auto renaming = RenamingModule{repo};
+    auto args = json{{"identifier", "z"}, {"offset", 29}, {"xpath", "/nta/declaration!"}, {"limit", 3}};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("find_usages", args);
+    args["continuation"] = 3;
+    mock.send("find_usages", args);
+    args["limit"] = 0;
+    mock.send("find_usages", args);
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(renaming).start();
+
+    auto usage = [](int start) { return json{{"start", start}, {"end", start + 1}, {"xpath", "/nta/declaration"}}; };
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK(mock.receive() == json{{"items", json::array({usage(29), usage(87), usage(92)})}, {"continuation", 3}});
+    CHECK(mock.receive() == json{{"items", json::array({usage(115)})}});
+    CHECK(mock.expect_error());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Concurrent find usages answers for the document it was sent for")
+{
+    auto repo = SystemRepository{};
+    auto renaming = RenamingModule{repo};
+    auto released = std::promise<void>{};
+    auto is_released = released.get_future().share();
+    auto changed = MODEL;
+    changed.replace(changed.find("const int x"), 0, "int w;\n");
+
+    // The only worker is blocked until the new model is uploaded, find_usages is queued behind it
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send_request(1, "wait", "");
+    mock.send_request(2, "find_usages", {{"identifier", "x"}, {"offset", 11}, {"xpath", "/nta/declaration!"}});
+    mock.send("upload", changed);
+    mock.send_cmd("release");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.set_worker_count(1).add_close_command("exit").add_module(repo).add_module(renaming);
+    server.add_read_only_command<const json&>("wait", [&](const json&) {
+        is_released.wait();
+        return OK_RESPONSE;
+    });
+    server.add_simple_command<json>("release", [&]() {
+        released.set_value();
+        return OK_RESPONSE;
+    });
+    server.start();
+
+    REQUIRE(mock.handshake());
+    auto messages = std::vector<json>{};
+    for (int i = 0; i < 6; ++i)
+        messages.push_back(mock.receive_message());
+    auto usages = std::ranges::find(messages, json(2), [](const json& message) { return message.value("id", json{}); });
+    REQUIRE(usages != messages.end());
+    CHECK((*usages)["info"] == json{{{"start", 11}, {"end", 12}, {"xpath", "/nta/declaration"}},
+                                    {{"start", 33}, {"end", 34}, {"xpath", "/nta/declaration"}},
+                                    {{"start", 41}, {"end", 42}, {"xpath", "/nta/declaration"}},
+                                    {{"start", 8}, {"end", 9}, {"xpath", "/nta/template[1]/declaration"}}});
+    CHECK_EOF(mock);
+}
+
 std::string MODEL2 = R"(<?xml version="1.0" encoding="utf-8"?>
 <!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
 <nta>
@@ -219,3 +292,86 @@ TEST_CASE("Find template name")
     REQUIRE(mock.receive() == OK_RESPONSE);
     CHECK_EOF(mock);
 }
+
+std::string MODEL3 = R"(<?xml version="1.0" encoding="utf-8"?>
+<!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
+<nta>
+    <declaration>
+const int N = 3;
+int f(int a) {
+    return a * a + N;
+}
+    </declaration>
+	<template>
+		<name x="5" y="5">Template</name>
+		<declaration>int t = N;
+int u = t + f(t);</declaration>
+		<location id="id0" x="-76" y="-68">
+			<name x="-86" y="-102">Init</name>
+		</location>
+		<init ref="id0"/>
+	</template>
+	<template>
+		<name x="5" y="5">Other</name>
+		<declaration>int t = N + 1;</declaration>
+		<location id="id1" x="-76" y="-68"/>
+		<init ref="id1"/>
+	</template>
+	<system>
+p = Template();
+q = Other();
+system p, q;
+</system>
+</nta>)";
+
+json request_usages(const std::string& model, const json& args)
+{
+    auto repo = SystemRepository{};
+    auto renaming = RenamingModule{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", model);
+    mock.send("find_usages", args);
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(renaming).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    auto usages = mock.receive();
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+    return usages;
+}
+
+TEST_CASE("Find usages of a template local variable")
+{
+    auto usages =
+        request_usages(MODEL3, {{"identifier", "t"}, {"offset", 4}, {"xpath", "/nta/template[1]/declaration!"}});
+
+    // The t declared by the other template is a different symbol
+    CHECK(usages == json{{{"start", 4}, {"end", 5}, {"xpath", "/nta/template[1]/declaration"}},
+                         {{"start", 19}, {"end", 20}, {"xpath", "/nta/template[1]/declaration"}},
+                         {{"start", 25}, {"end", 26}, {"xpath", "/nta/template[1]/declaration"}}});
+}
+
+TEST_CASE("Find usages of a function parameter")
+{
+    auto usages = request_usages(MODEL3, {{"identifier", "a"}, {"offset", 44}, {"xpath", "/nta/declaration!"}});
+
+    CHECK(usages == json{{{"start", 28}, {"end", 29}, {"xpath", "/nta/declaration"}},
+                         {{"start", 44}, {"end", 45}, {"xpath", "/nta/declaration"}},
+                         {{"start", 48}, {"end", 49}, {"xpath", "/nta/declaration"}}});
+}
+
+TEST_CASE("Usages found in separate templates are merged in document order")
+{
+    auto usages =
+        request_usages(MODEL3, {{"identifier", "N"}, {"offset", 8}, {"xpath", "/nta/template[2]/declaration!"}});
+
+    CHECK(usages == json{{{"start", 11}, {"end", 12}, {"xpath", "/nta/declaration"}},
+                         {{"start", 52}, {"end", 53}, {"xpath", "/nta/declaration"}},
+                         {{"start", 8}, {"end", 9}, {"xpath", "/nta/template[1]/declaration"}},
+                         {{"start", 8}, {"end", 9}, {"xpath", "/nta/template[2]/declaration"}}});
+}
@@ -4,6 +4,13 @@
 
 #include <iostream>
 #include <sstream>
+#include <future>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <mutex>
+#include <set>
+#include <thread>
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
@@ -125,4 +132,443 @@ TEST_CASE("Stop command")
     REQUIRE(mock.handshake());
     REQUIRE(mock.receive() == OK_RESPONSE);
     CHECK_EOF(mock);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Stats command counts handled requests")
+{
+    auto mock = MockIO{};
+    mock.send_cmd("get");
+    mock.send_cmd("get");
+    mock.send_cmd("stats");
+    mock.send_cmd("exit");
+
+    auto stats_module = StatsModule{};
+    auto server = Server{mock};
+    server.add_close_command("exit")
+        .add_simple_command<json>("get", []() { return OK_RESPONSE; })
+        .add_module(stats_module)
+        .start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    json stats = mock.receive();
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+
+    REQUIRE(stats.contains("get"));
+    CHECK(stats["get"]["count"] == 2);
+    CHECK(stats["get"]["p50_us"] <= stats["get"]["p99_us"]);
+    CHECK_FALSE(stats.contains("stats"));
+}
+
+TEST_CASE("Unknown command responds with an error")
+{
+    auto mock = MockIO{};
+    mock.send_cmd("missing");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == "Unknown command missing");
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Raw arguments can be moved out of the message")
+{
+    auto mock = MockIO{};
+    mock.send("take", {{"text", "hello"}});
+    mock.send_cmd("exit");
+
+    std::string text;
+    auto server = Server{mock};
+    server.add_close_command("exit")
+        .add_command<json&>("take",
+                            [&](json& args) {
+                                text = std::move(args["text"].get_ref<std::string&>());
+                                return OK_RESPONSE;
+                            })
+        .start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+    CHECK(text == "hello");
+}
+
+struct FlushCounter : std::stringbuf
+{
+    int flushes = 0;
+
+    int sync() override
+    {
+        ++flushes;
+        return std::stringbuf::sync();
+    }
+};
+
+TEST_CASE("Buffered messages are answered with a single flush")
+{
+    auto mock = MockIO{};
+    mock.send_cmd("get");
+    mock.send_cmd("get");
+    mock.send_cmd("get");
+    mock.send_cmd("exit");
+
+    auto counter = FlushCounter{};
+    auto out = std::ostream{&counter};
+    auto server = Server{{mock.in_buf, out}};
+    server.add_close_command("exit").add_simple_command<json>("get", []() { return OK_RESPONSE; }).start();
+
+    // One for the handshake and one for the batch
+    CHECK(counter.flushes == 2);
+    auto response = [](const std::string& cmd) { return R"({"info":["OK"],"res":"response/)" + cmd + "\"}\n"; };
+    CHECK(counter.str() == "json\n" + response("get") + response("get") + response("get") + response("exit"));
+}
+
+TEST_CASE("Request ids are echoed in responses")
+{
+    auto mock = MockIO{};
+    mock.send_request(7, "get", "");
+    mock.send_request("abc", "missing", "");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_simple_command<json>("get", []() { return OK_RESPONSE; }).start();
+
+    REQUIRE(mock.handshake());
+    CHECK(mock.receive_message() == json{{"id", 7}, {"res", "response/get"}, {"info", OK_RESPONSE}});
+    CHECK(mock.receive_message() == json{{"id", "abc"}, {"res", "err"}, {"info", "Unknown command missing"}});
+    CHECK(mock.receive_message() == json{{"res", "response/exit"}, {"info", OK_RESPONSE}});
+    CHECK_EOF(mock);
+}
+
+/** Read-only command which blocks until the "release" command is handled */
+struct BlockingCommands
+{
+    std::promise<void> released;
+    std::shared_future<void> is_released{released.get_future().share()};
+
+    void add_to(Server& server)
+    {
+        server.add_read_only_command<const json&>("slow", [this](const json&) {
+            is_released.wait();
+            return json{"slow"};
+        });
+        server.add_simple_command<json>("release", [this]() {
+            released.set_value();
+            return OK_RESPONSE;
+        });
+    }
+};
+
+TEST_CASE("Read-only requests with ids are answered out of order")
+{
+    auto mock = MockIO{};
+    mock.send_request(1, "slow", "");
+    mock.send_cmd("release");
+    mock.send_cmd("exit");
+
+    auto blocking = BlockingCommands{};
+    auto server = Server{mock};
+    server.add_close_command("exit");
+    blocking.add_to(server);
+    server.start();
+
+    // Release is handled while the slow request is blocked, so the slow response may come after it
+    REQUIRE(mock.handshake());
+    auto messages = std::vector<json>{mock.receive_message(), mock.receive_message(), mock.receive_message()};
+    CHECK(std::ranges::count(messages, json{{"id", 1}, {"res", "response/slow"}, {"info", {"slow"}}}) == 1);
+    CHECK(std::ranges::count(messages, json{{"res", "response/release"}, {"info", OK_RESPONSE}}) == 1);
+    CHECK(std::ranges::count(messages, json{{"res", "response/exit"}, {"info", OK_RESPONSE}}) == 1);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Cancel drops queued requests")
+{
+    auto mock = MockIO{};
+    mock.send_request(1, "slow", "");
+    mock.send_request(2, "slow", "");
+    mock.send("cancel", 2);
+    mock.send("cancel", 3);
+    mock.send_cmd("release");
+    mock.send_cmd("exit");
+
+    auto blocking = BlockingCommands{};
+    auto server = Server{mock};
+    server.set_worker_count(1).add_close_command("exit").add_cancel_command("cancel");
+    blocking.add_to(server);
+    server.start();
+
+    REQUIRE(mock.handshake());
+    CHECK(mock.receive_message() == json{{"id", 2}, {"res", "err"}, {"info", "Request cancelled"}});
+    CHECK(mock.receive() == OK_RESPONSE);
+    CHECK(mock.receive() == FAIL_RESPONSE);
+    auto messages = std::vector<json>{mock.receive_message(), mock.receive_message(), mock.receive_message()};
+    CHECK(std::ranges::count(messages, json{{"id", 1}, {"res", "response/slow"}, {"info", {"slow"}}}) == 1);
+    CHECK(std::ranges::count(messages, json{{"id", 2}, {"res", "response/slow"}, {"info", {"slow"}}}) == 0);
+    CHECK_EOF(mock);
+}
+
+// Value of the batch context entered on this thread
+thread_local int entered_value = 0;
+
+TEST_CASE("Concurrent requests run in the batch contexts captured when they were received")
+{
+    auto mock = MockIO{};
+    mock.send_request(1, "slow", "");
+    mock.send_request(2, "get", "");
+    mock.send_request(3, "batch", json::array({{{"cmd", "get"}, {"args", ""}}}));
+    mock.send("set", 2);
+    mock.send_request(4, "get", "");
+    mock.send_cmd("release");
+    mock.send_cmd("exit");
+
+    int value = 1;
+    auto blocking = BlockingCommands{};
+    auto server = Server{mock};
+    server.set_worker_count(1)
+        .add_close_command("exit")
+        .add_batch_command("batch")
+        .add_batch_context([&value] {
+            return [captured = value]() -> std::shared_ptr<void> {
+                auto restore = [previous = entered_value](void*) { entered_value = previous; };
+                entered_value = captured;
+                return {nullptr, restore};
+            };
+        })
+        .add_read_only_command<const json&>("get", [](const json&) { return json(entered_value); })
+        .add_command<const json&>("set", [&value](const json& x) {
+            value = x.get<int>();
+            return OK_RESPONSE;
+        });
+    blocking.add_to(server);
+    server.start();
+
+    // The worker only runs the requests once set was handled, they still see the value from when they were sent
+    REQUIRE(mock.handshake());
+    auto messages = std::vector<json>{};
+    for (int i = 0; i < 7; ++i)
+        messages.push_back(mock.receive_message());
+    CHECK(std::ranges::count(messages, json{{"id", 2}, {"res", "response/get"}, {"info", 1}}) == 1);
+    CHECK(std::ranges::count(messages, json{{"id", 3}, {"res", "response/batch"}, {"info", {1}}}) == 1);
+    CHECK(std::ranges::count(messages, json{{"id", 4}, {"res", "response/get"}, {"info", 2}}) == 1);
+    CHECK_EOF(mock);
+    CHECK(entered_value == 0);
+}
+
+TEST_CASE("Messages are framed CBOR after switching wire format")
+{
+    auto mock = MockIO{};
+    mock.send("wire_format", "cbor");
+    auto document = std::string{"<nta>\"quoted\" \\ </nta>"};
+    mock.send_frame({{"id", 4}, {"cmd", "echo"}, {"args", json::binary({document.begin(), document.end()})}});
+    mock.send_frame({{"cmd", "exit"}, {"args", ""}});
+
+    auto server = Server{mock};
+    server.add_close_command("exit")
+        .add_wire_format_command("wire_format")
+        .add_command<std::string>("echo", [](std::string text) { return text; })
+        .start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK(mock.receive_frame() == json{{"id", 4}, {"res", "response/echo"}, {"info", {document}}});
+    CHECK(mock.receive_frame() == json{{"res", "response/exit"}, {"info", OK_RESPONSE}});
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Unknown wire format keeps json")
+{
+    auto mock = MockIO{};
+    mock.send("wire_format", "xml");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_wire_format_command("wire_format").start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == "Unknown wire format xml");
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("String arguments can be viewed or moved")
+{
+    auto mock = MockIO{};
+    mock.send("length", "four");
+    mock.send("list", json::array({"a", "b"}));
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit")
+        .add_command<std::string_view>("length", [](std::string_view text) { return std::to_string(text.size()); })
+        .add_command<std::vector<std::string>>("list", [](std::vector<std::string> items) { return items; })
+        .start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == json{"4"});
+    REQUIRE(mock.receive() == json{{"a"}, {"b"}});
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("parallel_for runs every index once and rethrows task errors")
+{
+    auto calls = std::vector<std::atomic<int>>(1000);
+    parallel_for(calls.size(), [&](size_t i) { calls[i]++; }, 4);
+    CHECK(std::ranges::all_of(calls, [](const std::atomic<int>& count) { return count == 1; }));
+
+    parallel_for(0, [](size_t) { FAIL("No calls expected"); });
+    auto fail_seventh = [](size_t i) {
+        if (i == 7)
+            throw std::runtime_error{"failed"};
+    };
+    CHECK_THROWS_AS(parallel_for(10, fail_seventh, 3), std::runtime_error);
+}
+
+TEST_CASE("Concurrent parallel_for calls share their helper threads")
+{
+    constexpr size_t callers = 8;
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+    auto calls = std::vector<std::atomic<int>>(callers * 100);
+    {
+        std::vector<std::jthread> running;
+        for (size_t caller = 0; caller < callers; ++caller) {
+            running.emplace_back([&, caller] {
+                parallel_for(100, [&](size_t i) {
+                    calls[caller * 100 + i]++;
+                    auto lock = std::lock_guard{mutex};
+                    threads.insert(std::this_thread::get_id());
+                });
+            });
+        }
+    }
+    CHECK(std::ranges::all_of(calls, [](const std::atomic<int>& count) { return count == 1; }));
+    // Each caller helps itself, the helpers beyond that are one less than the cores of the machine
+    CHECK(threads.size() <= callers + std::max(1U, std::thread::hardware_concurrency()) - 1);
+}
+
+TEST_CASE("Batch runs read-only commands and reports errors per item")
+{
+    auto mock = MockIO{};
+    mock.send("batch", json::array({{{"cmd", "square"}, {"args", 3}},
+                                    {{"cmd", "inc"}, {"args", 1}},
+                                    {{"cmd", "missing"}, {"args", 1}},
+                                    {{"cmd", "square"}, {"args", "text"}}}));
+    mock.send("batch", 5);
+    mock.send_cmd("exit");
+
+    int contexts = 0;
+    auto server = Server{mock};
+    server.add_close_command("exit")
+        .add_batch_command("batch")
+        .add_batch_context([&contexts] {
+            ++contexts;
+            return [] { return std::shared_ptr<void>{}; };
+        })
+        .add_read_only_command<const json&>("square", [](const json& x) { return json(x.get<int>() * x.get<int>()); })
+        .add_command<const json&>("inc", [](const json& x) { return json(x.get<int>() + 1); })
+        .start();
+
+    REQUIRE(mock.handshake());
+    auto responses = mock.receive();
+    REQUIRE(responses.size() == 4);
+    CHECK(responses[0] == 9);
+    CHECK(responses[1] == json{{"error", "Only read-only commands can be batched"}});
+    CHECK(responses[2].contains("error"));
+    CHECK(responses[3].contains("error"));
+    CHECK(mock.expect_error());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+    CHECK(contexts == 1);
+}
+
+/** Streams the numbers from 0 up to the "n" of the arguments */
+void count_up(const json& args, ResultSink& sink)
+{
+    for (int i = 0; i < args["n"].get<int>(); ++i) {
+        if (!sink.push(i))
+            return;
+    }
+}
+
+TEST_CASE("Streaming commands page their results with a limit and continuation")
+{
+    auto mock = MockIO{};
+    mock.send("count", {{"n", 5}});
+    mock.send("count", {{"n", 5}, {"limit", 2}});
+    mock.send("count", {{"n", 5}, {"limit", 2}, {"continuation", 4}});
+    mock.send("batch", json::array({{{"cmd", "count"}, {"args", {{"n", 3}, {"limit", 2}}}}}));
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_batch_command("batch").add_streaming_command<const json&>("count", count_up);
+    server.start();
+
+    REQUIRE(mock.handshake());
+    CHECK(mock.receive() == json{0, 1, 2, 3, 4});
+    CHECK(mock.receive() == json{{"items", {0, 1}}, {"continuation", 2}});
+    CHECK(mock.receive() == json{{"items", {4}}});
+    CHECK(mock.receive() == json::array({{{"items", {0, 1}}, {"continuation", 2}}}));
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Streaming commands reject limits and continuations that cannot page")
+{
+    auto mock = MockIO{};
+    mock.send("count", {{"n", 5}, {"limit", 0}});
+    mock.send("count", {{"n", 5}, {"limit", -1}});
+    mock.send("count", {{"n", 5}, {"limit", "2"}});
+    mock.send("count", {{"n", 5}, {"limit", 2}, {"continuation", -2}});
+    mock.send("batch", json::array({{{"cmd", "count"}, {"args", {{"n", 3}, {"limit", 0}}}}}));
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_batch_command("batch").add_streaming_command<const json&>("count", count_up);
+    server.start();
+
+    REQUIRE(mock.handshake());
+    for (int i = 0; i < 4; ++i)
+        CHECK(mock.expect_error());
+    auto batch = mock.receive();
+    REQUIRE(batch.size() == 1);
+    CHECK(batch[0].contains("error"));
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Streaming commands encode their results as CBOR frames")
+{
+    auto mock = MockIO{};
+    mock.send("wire_format", "cbor");
+    mock.send_frame({{"cmd", "count"}, {"args", {{"n", 30}}}});
+    mock.send_frame({{"cmd", "count"}, {"args", {{"n", 30}, {"limit", 25}}}});
+    mock.send_frame({{"cmd", "exit"}, {"args", ""}});
+
+    auto server = Server{mock};
+    server.add_close_command("exit")
+        .add_wire_format_command("wire_format")
+        .add_streaming_command<const json&>("count", count_up)
+        .start();
+
+    auto numbers = [](int from, int to) {
+        auto array = json::array();
+        for (int i = from; i < to; ++i)
+            array.push_back(i);
+        return array;
+    };
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK(mock.receive_frame() == json{{"res", "response/count"}, {"info", numbers(0, 30)}});
+    CHECK(mock.receive_frame() ==
+          json{{"res", "response/count"}, {"info", {{"items", numbers(0, 25)}, {"continuation", 25}}}});
+    CHECK(mock.receive_frame() == json{{"res", "response/exit"}, {"info", OK_RESPONSE}});
+    CHECK_EOF(mock);
+}
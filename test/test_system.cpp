@@ -0,0 +1,510 @@
+#include "server_mock.h"
+#include <uls/system.h>
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+using json = nlohmann::json;
+
+const std::string MODEL = R"(<?xml version="1.0" encoding="utf-8"?>
+<!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
+<nta>
+    <declaration>
+int x = 5;
+    </declaration>
+	<template>
+		<name x="5" y="5">Template</name>
+		<declaration>int y = x + 2;</declaration>
+		<location id="id0" x="-76" y="-68">
+			<name x="-86" y="-102">Init</name>
+		</location>
+		<init ref="id0"/>
+	</template>
+	<template>
+		<name x="5" y="5">Other</name>
+		<declaration>int z = x;</declaration>
+		<location id="id1" x="-76" y="-68"/>
+		<init ref="id1"/>
+	</template>
+	<system>
+p = Template();
+q = Other();
+system p, q;
+</system>
+</nta>)";
+
+std::string replace(std::string str, std::string_view from, std::string_view to)
+{
+    return str.replace(str.find(from), from.size(), to);
+}
+
+/** Records the changes reported through the document update event */
+struct ChangeRecorder : public ServerModule
+{
+    SystemRepository& repo;
+    std::vector<DocumentChange> changes;
+
+    ChangeRecorder(SystemRepository& repo): repo{repo} {}
+
+    void configure(Server& server) override
+    {
+        repo.add_on_document_update(
+            [this](DocumentSnapshot&, const DocumentChange& change) { changes.push_back(change); });
+        server.add_simple_command<json>("wait_parsed", [this]() {
+            repo.parse_pending();
+            repo.get_document();
+            return OK_RESPONSE;
+        });
+    }
+};
+
+std::vector<DocumentChange> upload_all(const std::vector<std::string>& models)
+{
+    auto repo = SystemRepository{};
+    auto recorder = ChangeRecorder{repo};
+
+    auto mock = MockIO{};
+    for (const std::string& model : models)
+        mock.send("upload", model);
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(recorder).start();
+    return recorder.changes;
+}
+
+TEST_CASE("First upload changes everything")
+{
+    auto changes = upload_all({MODEL});
+
+    REQUIRE(changes.size() == 1);
+    CHECK(changes[0].affects("/nta/template[2]/declaration!"));
+    CHECK(changes[0].affects("/nta/queries!"));
+}
+
+TEST_CASE("Identical upload is not reparsed")
+{
+    auto changes = upload_all({MODEL, MODEL});
+
+    CHECK(changes.size() == 1);
+}
+
+TEST_CASE("Template change only reports that template")
+{
+    auto changes = upload_all({MODEL, replace(MODEL, "int z = x;", "int z = x + 1;")});
+
+    REQUIRE(changes.size() == 2);
+    CHECK(changes[1].sections == std::vector<std::string>{"/nta/template[2]"});
+    CHECK(changes[1].affects("/nta/template[2]/declaration!"));
+    CHECK(changes[1].affects("/nta/system!"));
+    CHECK(changes[1].affects("/nta/queries!"));
+    CHECK_FALSE(changes[1].affects("/nta/template[1]/declaration!"));
+    CHECK_FALSE(changes[1].affects("/nta/declaration!"));
+}
+
+TEST_CASE("Global declaration change affects all templates")
+{
+    auto changes = upload_all({MODEL, replace(MODEL, "int x = 5;", "int x = 6;")});
+
+    REQUIRE(changes.size() == 2);
+    CHECK(changes[1].sections == std::vector<std::string>{"/nta/declaration"});
+    CHECK(changes[1].affects("/nta/template[1]/declaration!"));
+    CHECK(changes[1].affects("/nta/template[2]"));
+}
+
+TEST_CASE("System change does not affect templates")
+{
+    auto changes = upload_all({MODEL, replace(MODEL, "system p, q;", "system q, p;")});
+
+    REQUIRE(changes.size() == 2);
+    CHECK(changes[1].sections == std::vector<std::string>{"/nta/system"});
+    CHECK(changes[1].affects("/nta/queries!"));
+    CHECK_FALSE(changes[1].affects("/nta/template[1]/declaration!"));
+}
+
+TEST_CASE("Removing a template reports the removed section")
+{
+    auto model = MODEL;
+    auto start = model.find("\t<template>", model.find("</template>"));
+    model.erase(start, model.find("</template>", start) + 12 - start);
+    auto changes = upload_all({MODEL, model});
+
+    REQUIRE(changes.size() == 2);
+    CHECK(changes[1].sections == std::vector<std::string>{"/nta/template[2]"});
+}
+
+TEST_CASE("Unedited document keeps the uploaded xml")
+{
+    auto doc = WorkingDocument{};
+    doc.set_document(MODEL);
+
+    CHECK(doc.to_xml() == MODEL);
+    CHECK(doc.get_text("/nta/declaration!") == "\nint x = 5;\n    ");
+    CHECK(doc.get_text("/nta/template[2]/declaration") == "int z = x;");
+    CHECK(doc.get_text("/nta/template[1]/location[1]/name") == "Init");
+    CHECK(doc.get_text("/nta/system!") == "\np = Template();\nq = Other();\nsystem p, q;\n");
+}
+
+TEST_CASE("Text nodes are stored unescaped")
+{
+    auto model = replace(MODEL, "<init ref=\"id0\"/>",
+                         "<init ref=\"id0\"/>\n<transition><source ref=\"id0\"/><target ref=\"id0\"/>"
+                         "<label kind=\"guard\" x=\"0\" y=\"0\">y &lt; 5 &amp;&amp; y &gt;= 2</label></transition>");
+    auto doc = WorkingDocument{};
+    doc.set_document(model);
+
+    CHECK(doc.get_text("/nta/template[1]/transition[1]/label[@kind=\"guard\"]!") == "y < 5 && y >= 2");
+    doc.apply_edit({"/nta/template[1]/transition[1]/label[@kind=\"guard\"]!", 4, 1, "3"});
+    CHECK(doc.to_xml() == replace(model, "y &lt; 5", "y &lt; 3"));
+}
+
+TEST_CASE("Malformed entities are kept verbatim")
+{
+    auto doc = WorkingDocument{};
+    auto text = "int x = 5; // &#x41;&#65;&quot; &#x; &#99999999999; &#x110000; &b; & a;";
+    doc.set_document(replace(MODEL, "int x = 5;", text));
+
+    CHECK(doc.get_text("/nta/declaration") == "\nint x = 5; // AA\" &#x; &#99999999999; &#x110000; &b; & a;\n    ");
+}
+
+TEST_CASE("Edits replace text without leaving whitespace")
+{
+    auto doc = WorkingDocument{};
+    doc.set_document(MODEL);
+
+    doc.apply_edit({"/nta/template[1]/declaration!", 4, 1, "value"});
+    doc.apply_edit({"/nta/template[1]/declaration!", 13, 4, ""});
+    CHECK(doc.get_text("/nta/template[1]/declaration!") == "int value = x;");
+    CHECK(doc.to_xml() == replace(MODEL, "int y = x + 2;", "int value = x;"));
+
+    CHECK_THROWS(doc.apply_edit({"/nta/template[3]/declaration!", 0, 0, "int a;"}));
+    CHECK_THROWS(doc.apply_edit({"/nta/template[1]/declaration!", 10, 10, ""}));
+}
+
+TEST_CASE("Spilled markup is read back when the xml is needed")
+{
+    auto file = std::filesystem::temp_directory_path() / "uls_test_spilled_markup.xml";
+    auto doc = WorkingDocument{};
+    doc.set_document(MODEL);
+    auto resident = doc.get_memory_stats();
+
+    REQUIRE(doc.spill_markup(file));
+    CHECK(doc.is_spilled());
+    CHECK(doc.get_memory_stats().markup == 0);
+    CHECK(doc.get_memory_stats().spilled_markup == resident.markup);
+    CHECK(doc.memory_usage() == resident.markup + resident.text + resident.xpaths);
+
+    // Text nodes stay in memory and can still be edited
+    doc.apply_edit({"/nta/template[1]/declaration!", 4, 1, "value"});
+    CHECK(doc.to_xml() == replace(MODEL, "int y = x + 2;", "int value = x + 2;"));
+
+    doc.restore_markup();
+    CHECK_FALSE(doc.is_spilled());
+    CHECK_FALSE(std::filesystem::exists(file));
+    CHECK(doc.to_xml() == replace(MODEL, "int y = x + 2;", "int value = x + 2;"));
+}
+
+TEST_CASE("Edit command only reports the edited section")
+{
+    auto repo = SystemRepository{};
+    auto recorder = ChangeRecorder{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("edit", json::array({{{"xpath", "/nta/system!"}, {"offset", 1}, {"length", 1}, {"text", "r"}},
+                                   {{"xpath", "/nta/system!"}, {"offset", 37}, {"length", 1}, {"text", "r"}}}));
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(recorder).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+
+    CHECK(repo.get_working_document().get_text("/nta/system") == "\nr = Template();\nq = Other();\nsystem r, q;\n");
+    REQUIRE(recorder.changes.size() == 2);
+    CHECK(recorder.changes[1].sections == std::vector<std::string>{"/nta/system"});
+}
+
+TEST_CASE("Background parsing debounces uploads")
+{
+    auto repo = SystemRepository{};
+    repo.enable_background_parsing(std::chrono::hours{1});
+    auto recorder = ChangeRecorder{repo};
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("upload", replace(MODEL, "int x = 5;", "int x = 6;"));
+    mock.send("upload", replace(MODEL, "int x = 5;", "int x = 7;"));
+    mock.send_cmd("wait_parsed");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(recorder).start();
+
+    REQUIRE(mock.handshake());
+    for (int i = 0; i < 5; ++i)
+        REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+
+    // All uploads arrive within the debounce period, which wait_parsed cuts short, so only the last one is parsed
+    REQUIRE(recorder.changes.size() == 1);
+    CHECK(repo.get_working_document().get_text("/nta/declaration") == "\nint x = 7;\n    ");
+}
+
+TEST_CASE("Commands waiting for the first parse are answered when it fails")
+{
+    for (bool is_background : {false, true}) {
+        auto repo = SystemRepository{};
+        if (is_background)
+            repo.enable_background_parsing(std::chrono::milliseconds{0});
+
+        auto mock = MockIO{};
+        mock.send("upload", "<nta><template><declaration>int x = </declaration>");
+        mock.send_cmd("probe");
+        mock.send_cmd("exit");
+
+        auto server = Server{mock};
+        server.add_close_command("exit").add_module(repo);
+        server.add_simple_command<json>("probe", [&] {
+            repo.get_snapshot();
+            return OK_RESPONSE;
+        });
+        server.start();
+
+        // A model UTAP cannot read fails the upload or the probe, the probe must not wait for a parse forever
+        REQUIRE(mock.handshake());
+        auto upload = mock.receive_message();
+        auto probe = mock.receive_message();
+        CHECK((upload["info"] == OK_RESPONSE || upload["res"] == "err"));
+        CHECK((probe["info"] == OK_RESPONSE || probe["res"] == "err"));
+        REQUIRE(mock.receive() == OK_RESPONSE);
+        CHECK_EOF(mock);
+    }
+}
+
+TEST_CASE("Switching documents keeps both parsed")
+{
+    auto repo = SystemRepository{};
+    auto recorder = ChangeRecorder{repo};
+    auto other = replace(MODEL, "int x = 5;", "int x = 6;");
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("select_document", "other.xml");
+    mock.send("upload", other);
+    mock.send("select_document", "");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).add_module(recorder).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == FAIL_RESPONSE);  // New document which must be uploaded
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+
+    // Selecting the first document again reports it as changed without parsing it again
+    REQUIRE(recorder.changes.size() == 3);
+    CHECK(recorder.changes[2].sections == DocumentChange::everything().sections);
+    CHECK(repo.get_working_document().to_xml() == MODEL);
+}
+
+TEST_CASE("Least recently selected document is closed when over budget")
+{
+    auto repo = SystemRepository{};
+    auto size = [] {
+        auto doc = WorkingDocument{};
+        doc.set_document(MODEL);
+        return doc.memory_usage();
+    }();
+    repo.set_memory_budget(2 * size + size / 2);
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("select_document", "b");
+    mock.send("upload", MODEL);
+    mock.send("select_document", "c");
+    mock.send("upload", MODEL);
+    mock.send("select_document", "b");
+    mock.send("select_document", "");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).start();
+
+    REQUIRE(mock.handshake());
+    for (int i = 0; i < 5; ++i)
+        REQUIRE(mock.receive() == (i == 1 || i == 3 ? FAIL_RESPONSE : OK_RESPONSE));
+    CHECK(mock.receive() == OK_RESPONSE);    // b is still open
+    CHECK(mock.receive() == FAIL_RESPONSE);  // "" was closed when c was uploaded
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+}
+
+TEST_CASE("Compact storage spills documents that are not selected")
+{
+    auto directory = std::filesystem::temp_directory_path() / "uls_test_compact_storage";
+    std::filesystem::remove_all(directory);
+    auto repo = SystemRepository{};
+    repo.enable_compact_storage(directory);
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send("select_document", "b");
+    mock.send("upload", MODEL);
+    mock.send_cmd("memory_stats");
+    mock.send("select_document", "");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo).start();
+
+    REQUIRE(mock.handshake());
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == FAIL_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    auto stats = mock.receive();
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+
+    auto spilled = stats["documents"][""];
+    auto selected = stats["documents"]["b"];
+    CHECK(spilled["markup"] == 0);
+    CHECK(spilled["spilled_markup"] == selected["markup"]);
+    CHECK(selected["spilled_markup"] == 0);
+    CHECK(spilled["is_parsed"] == true);
+    CHECK(stats["total"] > 0);
+
+    // Selecting the document again brings its markup back and removes its file, only b is spilled now
+    CHECK(repo.get_working_document().to_xml() == MODEL);
+    CHECK_FALSE(repo.get_working_document().is_spilled());
+    auto files = std::filesystem::directory_iterator{directory};
+    CHECK(std::distance(begin(files), end(files)) == 1);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Saved responses answer an unchanged model before it is parsed")
+{
+    auto directory = std::filesystem::temp_directory_path() / "uls_test_response_cache";
+    // Entities are escaped differently once the text nodes are stored, both must hash the same content
+    auto with_entities = replace(MODEL, "int x = 5;", "int x = 5; // &quot;&apos;&#65; &gt;");
+
+    for (const std::string& model : {MODEL, with_entities}) {
+        std::filesystem::remove_all(directory);
+        int probe_count = 0;
+
+        auto run_session = [&](bool defer_parse) {
+            auto repo = SystemRepository{};
+            repo.enable_response_cache(directory);
+            if (defer_parse)
+                repo.enable_background_parsing(std::chrono::hours{1});
+
+            auto mock = MockIO{};
+            mock.send("upload", model);
+            mock.send("probe", "/nta/declaration");
+            mock.send("probe", "/nta/system");
+            // Asked in one session only, so it is never answered from saved responses
+            auto question = defer_parse ? "second session" : "first session";
+            mock.send("echo", question);
+            mock.send_cmd("memory_stats");
+            mock.send_cmd("exit");
+
+            auto server = Server{mock};
+            server.add_close_command("exit").add_module(repo);
+            server.add_read_only_command<std::string>("probe", [&](const std::string& xpath) {
+                repo.get_snapshot();
+                return json{xpath, ++probe_count};
+            });
+            server.add_read_only_command<std::string>("echo", [](const std::string& text) { return json{text}; });
+            server.start();
+
+            REQUIRE(mock.handshake());
+            REQUIRE(mock.receive() == OK_RESPONSE);
+            auto first = mock.receive();
+            auto second = mock.receive();
+            REQUIRE(mock.receive() == json{question});
+            auto stats = mock.receive()["documents"][""];
+            REQUIRE(mock.receive() == OK_RESPONSE);
+            CHECK_EOF(mock);
+            auto lookups = json{stats["saved_response_hits"], stats["saved_response_misses"]};
+            return std::pair{std::vector{first, second}, lookups};
+        };
+
+        auto [computed, computed_lookups] = run_session(false);
+        CHECK(computed == std::vector<json>{{"/nta/declaration", 1}, {"/nta/system", 2}});
+        CHECK(computed_lookups == json{0, 0});
+
+        // The second session never finishes its first parse, so only saved responses can answer
+        auto [saved, saved_lookups] = run_session(true);
+        CHECK(saved == computed);
+        CHECK(probe_count == 2);
+        // Only the commands sent with the same arguments as before are answered without the parse
+        CHECK(saved_lookups == json{2, 1});
+    }
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Idle handlers see the merged changes once updates stop")
+{
+    auto repo = SystemRepository{};
+    repo.set_idle_period(std::chrono::hours{1});
+    std::vector<DocumentChange> idle_changes;
+    std::mutex idle_mutex;
+    std::condition_variable idle_called;
+    size_t waited = 0;
+
+    auto mock = MockIO{};
+    mock.send("upload", MODEL);
+    mock.send_cmd("wait_idle");
+    mock.send("upload", replace(MODEL, "int z = x;", "int z = x + 1;"));
+    mock.send("upload", replace(replace(MODEL, "int z = x;", "int z = x + 1;"), "system p, q;", "system q, p;"));
+    mock.send_cmd("wait_idle");
+    mock.send_cmd("exit");
+
+    auto server = Server{mock};
+    server.add_close_command("exit").add_module(repo);
+    repo.add_on_document_idle([&](DocumentSnapshot&, const DocumentChange& change) {
+        {
+            auto lock = std::lock_guard{idle_mutex};
+            idle_changes.push_back(change);
+        }
+        idle_called.notify_all();
+    });
+    // Cuts the idle period short, the uploads in between arrive well within it
+    server.add_simple_command<json>("wait_idle", [&] {
+        repo.flush_idle();
+        auto lock = std::unique_lock{idle_mutex};
+        size_t expected = ++waited;
+        idle_called.wait(lock, [&] { return idle_changes.size() >= expected; });
+        return OK_RESPONSE;
+    });
+    server.start();
+
+    REQUIRE(mock.handshake());
+    for (int i = 0; i < 6; ++i)
+        REQUIRE(mock.receive() == OK_RESPONSE);
+    CHECK_EOF(mock);
+
+    auto lock = std::lock_guard{idle_mutex};
+    REQUIRE(idle_changes.size() == 2);
+    CHECK(idle_changes[0].sections == DocumentChange::everything().sections);
+    CHECK(idle_changes[1].sections == std::vector<std::string>{"/nta/system", "/nta/template[2]"});
+}
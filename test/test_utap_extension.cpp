@@ -0,0 +1,151 @@
+#include <uls/utap_extension.h>
+#include <uls/system.h>
+#include <nlohmann/json.hpp>
+
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+
+using json = nlohmann::json;
+
+const std::string MODEL = R"(<?xml version="1.0" encoding="utf-8"?>
+<!DOCTYPE nta PUBLIC '-//Uppaal Team//DTD Flat System 1.5//EN' 'http://www.it.uu.se/research/group/darts/uppaal/flat-1_5.dtd'>
+<nta>
+    <declaration>
+int x = 1;
+int g = 2;
+    </declaration>
+	<template>
+		<name x="5" y="5">Template</name>
+		<declaration>int x = 3;
+int f(int y) {
+    int x = y;
+    return x + g;
+}
+int h() {
+    return x;
+}</declaration>
+		<location id="id0" x="-76" y="-68">
+			<name x="-86" y="-102">Init</name>
+		</location>
+		<init ref="id0"/>
+	</template>
+	<template>
+		<name x="5" y="5">Other</name>
+		<declaration>int z = x;</declaration>
+		<location id="id1" x="-76" y="-68"/>
+		<init ref="id1"/>
+	</template>
+	<system>
+p = Template();
+q = Other();
+system p, q;
+</system>
+</nta>)";
+
+std::shared_ptr<DocumentSnapshot> parse(const std::string& model)
+{
+    auto doc = WorkingDocument{};
+    doc.set_document(model);
+    return std::make_shared<DocumentSnapshot>(doc.parse(), 1);
+}
+
+/** Where the symbol is declared, in the format the commands respond with */
+json locate(DocumentSnapshot& snapshot, const std::optional<UTAP::symbol_t>& symbol)
+{
+    REQUIRE(symbol.has_value());
+    return Serializer<TextLocation>::serialize({snapshot.get<PositionTable>(), symbol->get_position()});
+}
+
+json location(std::string xpath, uint32_t start) { return {{"xpath", xpath}, {"start", start}, {"end", start + 1}}; }
+
+TEST_CASE("Symbol index finds the innermost declaration of a name")
+{
+    auto snapshot = parse(MODEL);
+    auto& index = snapshot->get<SymbolIndex>();
+    auto& globals = navigate_xpath(*snapshot, "/nta/declaration!");
+    auto& templ = navigate_xpath(*snapshot, "/nta/template[1]/declaration!");
+    auto& other = navigate_xpath(*snapshot, "/nta/template[2]/declaration!");
+
+    CHECK(locate(*snapshot, index.find(globals, "x")) == location("/nta/declaration", 5));
+    CHECK(locate(*snapshot, index.find(templ, "x")) == location("/nta/template[1]/declaration", 4));
+    CHECK(locate(*snapshot, index.find(templ, "g")) == location("/nta/declaration", 16));
+    CHECK(locate(*snapshot, index.find(other, "x")) == location("/nta/declaration", 5));
+
+    // Names of other templates and of function locals are not visible
+    CHECK_FALSE(index.find(other, "f").has_value());
+    CHECK_FALSE(index.find(templ, "y").has_value());
+    CHECK_FALSE(index.find(globals, "missing").has_value());
+}
+
+TEST_CASE("Symbol index finds processes by name")
+{
+    auto snapshot = parse(MODEL);
+    auto& index = snapshot->get<SymbolIndex>();
+
+    REQUIRE(index.find_process("p").has_value());
+    CHECK(index.find_process("p")->get().uid.get_name() == "Template");
+    REQUIRE(index.find_process("q").has_value());
+    CHECK(index.find_process("q")->get().uid.get_name() == "Other");
+    CHECK_FALSE(index.find_process("Template").has_value());
+}
+
+TEST_CASE("Xpaths resolve to the scope they name")
+{
+    auto snapshot = parse(MODEL);
+    UTAP::Document& doc = snapshot->get_document();
+
+    CHECK(&navigate_xpath(*snapshot, "/nta/declaration!") == &doc.get_globals());
+    CHECK(&navigate_xpath(*snapshot, "/nta/system!") == &doc.get_system_declarations());
+    CHECK(&navigate_xpath(*snapshot, "/nta/template[2]/declaration!") == &doc.get_templates().back());
+    CHECK(&navigate_xpath(*snapshot, "/nta/template[1]/location[1]/name") == &doc.get_templates().front());
+}
+
+TEST_CASE("Malformed or unknown xpaths throw")
+{
+    auto snapshot = parse(MODEL);
+
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[0]/declaration!"), std::out_of_range);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[3]/declaration!"), std::out_of_range);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[99999999999999999999]/declaration!"), std::out_of_range);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[x]/declaration!"), std::invalid_argument);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[1x]/declaration!"), std::invalid_argument);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[-1]/declaration!"), std::invalid_argument);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[1"), std::invalid_argument);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/unknown!"), std::invalid_argument);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/bad"), std::invalid_argument);
+
+    // Failed lookups are not cached
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/template[3]/declaration!", 0), std::out_of_range);
+    CHECK_THROWS_AS(navigate_xpath(*snapshot, "/nta/unknown!"), std::invalid_argument);
+}
+
+TEST_CASE("Offsets resolve to the innermost function body")
+{
+    auto snapshot = parse(MODEL);
+    auto& index = snapshot->get<SymbolIndex>();
+    const std::string path = "/nta/template[1]/declaration!";
+    const std::string node = "/nta/template[1]/declaration";
+    auto& templ = navigate_xpath(*snapshot, path);
+
+    CHECK(&navigate_xpath(*snapshot, path, 4) == &templ);
+    CHECK(&navigate_xpath(*snapshot, path, 63) == &templ);  // Between the bodies of f and h
+    auto& f = navigate_xpath(*snapshot, path, 38);
+    auto& h = navigate_xpath(*snapshot, path, 82);
+    CHECK(&f != &templ);
+    CHECK(&h != &templ);
+    CHECK(&f != &h);
+    CHECK(&navigate_xpath(*snapshot, path, 52) == &f);
+
+    // x is declared globally, in the template and in f, each scope sees the innermost declaration
+    CHECK(locate(*snapshot, index.find(f, "x")) == location(node, 34));
+    CHECK(locate(*snapshot, index.find(h, "x")) == location(node, 4));
+    CHECK(locate(*snapshot, index.find(templ, "x")) == location(node, 4));
+    CHECK(locate(*snapshot, index.find(f, "y")) == location(node, 21));
+    CHECK(locate(*snapshot, index.find(f, "g")) == location("/nta/declaration", 16));
+    CHECK_FALSE(index.find(h, "y").has_value());
+}